@@ -1,22 +1,64 @@
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
 #include <bitset.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <gc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <vec.h>
 
-#define bitset_equals(b1, b2) bitset_intersection_count(b1, b2) == bitset_count(b1)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#define bitset_equals(b1, b2)                                                                                          \
+    (bitset_count(b1) == bitset_count(b2) && bitset_intersection_count(b1, b2) == bitset_count(b1))
 
 #define EDGE_EMPTY (-3)
 #define EDGE_CHARACTER_CLASS (-2)
 #define EDGE_EPSILON 0
 
+// what a DFA reads for every byte no pattern can mention: NUL, DEL and
+// everything above. only the loops nfa_search adds take it, so such bytes
+// end any match in progress without ending the line
+#define BYTE_OTHER 0x7F
+
 #define ANCHOR_NONE 0
 #define ANCHOR_BOL (1 << 0)
 #define ANCHOR_EOL (1 << 1)
 #define ANCHOR_BOTH (ANCHOR_BOL | ANCHOR_EOL)
 
+#define REGEX_FOLD_CASE (1 << 0)
+// a single pattern from the command line rather than a rules file: a blank
+// is an ordinary character, and there are no actions, declarations or
+// start conditions
+#define REGEX_PATTERN (1 << 1)
+
+// how the end of r is recovered for a rule of the form r/s
+#define TRAIL_NONE 0
+#define TRAIL_FIXED_TAIL 1
+#define TRAIL_FIXED_HEAD 2
+#define TRAIL_VARIABLE 3
+
 typedef struct nfa_node_t
 {
     struct nfa_node_t *next[2];
@@ -24,18 +66,47 @@ typedef struct nfa_node_t
     bitset_t *bitset;
     bool complement;
     int anchor;
+    int accept;
+    // capture tag: 2k - 1 opens group k and 2k closes it, 0 for none
+    int tag;
     int index;
 } nfa_node_t;
 
 typedef vec_t(nfa_node_t *) vec_nfa_node_t;
 
 typedef struct
+{
+    nfa_node_t *start;
+    nfa_node_t *end;
+    // last node of r in r/s, NULL without trailing context
+    nfa_node_t *junction;
+    int anchor;
+    int trail;
+    int trail_length;
+    // s compiled right to left, used to find where r ends when neither
+    // side has a fixed length
+    struct nfa_t *tail;
+    // start conditions the rule is active in, NULL for the default set
+    bitset_t *conditions;
+    // the rest of the rule's line, NULL if there was none
+    char *action;
+} rule_t;
+
+typedef vec_t(rule_t) vec_rule_t;
+
+typedef struct nfa_t
 {
     vec_nfa_node_t nfa;
     size_t start;
+    vec_rule_t rules;
+    // start condition names, INITIAL first, and the entry node of each
+    vec_str_t conditions;
+    vec_int_t starts;
+    // capturing groups, numbered by their '('
+    int groups;
 } nfa_t;
 
-static nfa_t *thompson(const char *input);
+static nfa_t *thompson(const char *input, int flags);
 static void nfa_print(nfa_t *nfa);
 
 typedef enum
@@ -53,9 +124,41 @@ typedef enum
     tok_pipe,
     tok_plus,
     tok_question_mark,
+    tok_slash,
     tok_star,
+    tok_newline,
 } regex_token_t;
 
+// a pattern is parsed into a tree first, so it can be rewritten before any
+// NFA node exists
+typedef enum
+{
+    AST_EMPTY,
+    AST_CHAR,
+    AST_CLASS,
+    AST_CAT,
+    AST_ALT,
+    AST_STAR,
+    AST_PLUS,
+    AST_QUESTION,
+    AST_GROUP,
+} ast_kind_t;
+
+typedef struct ast_t
+{
+    ast_kind_t kind;
+    // AST_CHAR
+    char c;
+    // AST_CLASS
+    bitset_t *set;
+    bool complement;
+    // AST_GROUP
+    int group;
+    // the operands of AST_CAT and AST_ALT, or the single operand of a
+    // closure or group
+    vec_t(struct ast_t *) children;
+} ast_t;
+
 typedef struct
 {
     vec_nfa_node_t nfa;
@@ -65,6 +168,17 @@ typedef struct
     regex_token_t current_token;
     char current_lexeme;
     bool in_quote;
+    int flags;
+    bool in_class;
+    // concatenate right to left, for the reversed tail of r/s
+    bool reverse;
+    vec_rule_t rules;
+    vec_str_t conditions;
+    vec_int_t exclusive;
+    vec_nfa_node_t entries;
+    const char *action;
+    int action_length;
+    int groups;
 } nfa_parser_state_t;
 
 static nfa_node_t *alloc_nfa(nfa_parser_state_t *state)
@@ -82,9 +196,12 @@ static nfa_node_t *alloc_nfa(nfa_parser_state_t *state)
     int discarded = vec_pop(&state->discard_stack);
     state->nfa.data[discarded] = GC_malloc(sizeof(nfa_node_t));
     nfa_node_t *node = state->nfa.data[discarded];
+    node->next[0] = NULL;
+    node->next[1] = NULL;
     node->complement = false;
-    node->edge = EDGE_EMPTY;
+    node->edge = EDGE_EPSILON;
     node->anchor = ANCHOR_NONE;
+    node->tag = 0;
     node->bitset = bitset_create();
     node->index = discarded;
     return node;
@@ -92,9 +209,10 @@ static nfa_node_t *alloc_nfa(nfa_parser_state_t *state)
 
 static void discard_nfa(nfa_parser_state_t *state, nfa_node_t *node)
 {
+    // the node's contents (bitset included) have been copied into its
+    // predecessor by ast_build, so only the slot is released here
     int index = node->index;
     vec_push(&state->discard_stack, node->index);
-    bitset_clear(node->bitset);
     state->nfa.data[index] = NULL;
 }
 
@@ -118,6 +236,8 @@ static regex_token_t regex_token_from_char(char c)
         return tok_dot;
     case '?':
         return tok_question_mark;
+    case '/':
+        return tok_slash;
     case '[':
         return tok_left_bracket;
     case ']':
@@ -131,7 +251,7 @@ static regex_token_t regex_token_from_char(char c)
     }
 }
 
-static void nfa_parser_state_init(nfa_parser_state_t *state, const char *input)
+static void nfa_parser_state_init(nfa_parser_state_t *state, const char *input, int flags)
 {
     vec_init(&state->nfa);
     vec_init(&state->discard_stack);
@@ -140,6 +260,24 @@ static void nfa_parser_state_init(nfa_parser_state_t *state, const char *input)
     state->in_quote = false;
     state->input = input;
     state->input_start = input;
+    state->flags = flags;
+    state->in_class = false;
+    state->reverse = false;
+    vec_init(&state->rules);
+    vec_init(&state->conditions);
+    vec_init(&state->exclusive);
+    vec_init(&state->entries);
+    state->action = NULL;
+    state->action_length = 0;
+    state->groups = 0;
+}
+
+static char *copy_string(const char *s, size_t length)
+{
+    char *out = malloc(length + 1);
+    memcpy(out, s, length);
+    out[length] = '\0';
+    return out;
 }
 
 static char esc(const char **input)
@@ -162,22 +300,48 @@ static char esc(const char **input)
 
 static regex_token_t advance(nfa_parser_state_t *state)
 {
+    while (!state->in_class && *state->input == '"')
+    {
+        state->in_quote = !state->in_quote;
+        ++state->input;
+    }
     if (*state->input == '\0')
     {
         state->current_token = tok_eoi;
         state->current_lexeme = '\0';
         return tok_eoi;
     }
-    if (*state->input == '"')
+    if (*state->input == '\n')
     {
-        state->in_quote = !state->in_quote;
+        // each line of the input is a separate rule
+        if (state->in_quote)
+        {
+            fprintf(stderr, "encountered a newline inside a quoted string\n");
+            exit(1);
+        }
         ++state->input;
-        if (!*state->input)
+        state->current_token = tok_newline;
+        state->current_lexeme = '\n';
+        return tok_newline;
+    }
+    if (!state->in_quote && !state->in_class && !(state->flags & REGEX_PATTERN) &&
+        (*state->input == ' ' || *state->input == '\t'))
+    {
+        // as in lex, the pattern ends at the first unquoted blank and the
+        // rest of the line is its action
+        while (*state->input == ' ' || *state->input == '\t')
+        {
+            ++state->input;
+        }
+        state->action = state->input;
+        while (*state->input && *state->input != '\n')
         {
-            state->current_token = tok_eoi;
-            state->current_lexeme = '\0';
-            return tok_eoi;
+            ++state->input;
         }
+        state->action_length = state->input - state->action;
+        state->current_token = tok_newline;
+        state->current_lexeme = '\n';
+        return tok_newline;
     }
     bool saw_esc = *state->input == '\\';
     if (!state->in_quote)
@@ -202,29 +366,162 @@ static regex_token_t advance(nfa_parser_state_t *state)
     return state->current_token;
 }
 
-static void cat_expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
+static ast_t *cat_expr(nfa_parser_state_t *state);
 static void do_dash(nfa_parser_state_t *state, bitset_t *set);
-static void expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
-static void factor(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
+static void fold_case(bitset_t *set);
+static int group_flags(nfa_parser_state_t *state);
+static ast_t *expr(nfa_parser_state_t *state);
+static ast_t *factor(nfa_parser_state_t *state);
 static bool first_in_cat(regex_token_t token);
 static nfa_node_t *machine(nfa_parser_state_t *state);
+static bool declaration(nfa_parser_state_t *state);
+static bitset_t *condition_prefix(nfa_parser_state_t *state);
 static nfa_node_t *rule(nfa_parser_state_t *state);
-static void term(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
+static void trailing_context(nfa_parser_state_t *state, nfa_node_t **eptr, rule_t *r);
+static ast_t *term(nfa_parser_state_t *state);
+static ast_t *ast_simplify(ast_t *ast);
+static void ast_build(nfa_parser_state_t *state, const ast_t *ast, nfa_node_t **sptr, nfa_node_t **eptr);
+static void ast_free(ast_t *ast);
 static void nfa_print(nfa_t *nfa);
+static nfa_t *make_nfa(nfa_parser_state_t *state, nfa_node_t *start);
 
 static nfa_node_t *machine(nfa_parser_state_t *state)
 {
-    nfa_node_t *start = alloc_nfa(state);
-    nfa_node_t *p = start;
+    vec_push(&state->conditions, copy_string("INITIAL", 7));
+    vec_push(&state->exclusive, false);
     advance(state);
-    p->next[0] = rule(state);
     while (state->current_token != tok_eoi)
     {
-        p->next[1] = alloc_nfa(state);
-        p = p->next[1];
-        p->next[0] = rule(state);
+        if (state->current_token == tok_newline || declaration(state))
+        {
+            advance(state);
+            continue;
+        }
+        bitset_t *conditions = condition_prefix(state);
+        rule(state);
+        vec_last(&state->rules).conditions = conditions;
     }
-    return start;
+
+    // every start condition gets its own entry into the same machine; an
+    // entry is a chain of epsilon nodes over the rules active in it
+    for (int c = 0; c < state->conditions.length; ++c)
+    {
+        nfa_node_t *start = alloc_nfa(state);
+        nfa_node_t *p = NULL;
+        for (int i = 0; i < state->rules.length; ++i)
+        {
+            bitset_t *conditions = state->rules.data[i].conditions;
+            if (conditions ? !bitset_get(conditions, c) : state->exclusive.data[c])
+            {
+                continue;
+            }
+            if (p == NULL)
+            {
+                p = start;
+            }
+            else
+            {
+                p->next[1] = alloc_nfa(state);
+                p = p->next[1];
+            }
+            p->next[0] = state->rules.data[i].start;
+        }
+        vec_push(&state->entries, start);
+    }
+    return state->entries.data[0];
+}
+
+static bool declaration(nfa_parser_state_t *state)
+{
+    // %s NAME... declares inclusive start conditions, %x NAME... exclusive
+    // ones. rules without a <...> prefix are active in INITIAL and in every
+    // inclusive condition
+    const char *p = state->input;
+    if ((state->flags & REGEX_PATTERN) || state->in_quote || state->current_token != tok_literal ||
+        state->current_lexeme != '%' || (*p != 's' && *p != 'x') || (p[1] != ' ' && p[1] != '\t'))
+    {
+        return false;
+    }
+    bool exclusive = *p == 'x';
+    for (++p; *p && *p != '\n';)
+    {
+        if (*p == ' ' || *p == '\t')
+        {
+            ++p;
+            continue;
+        }
+        const char *name = p;
+        while (isalnum((unsigned char)*p) || *p == '_')
+        {
+            ++p;
+        }
+        if (p == name)
+        {
+            fprintf(stderr, "malformed start condition name\n");
+            exit(1);
+        }
+        vec_push(&state->conditions, copy_string(name, p - name));
+        vec_push(&state->exclusive, exclusive);
+    }
+    state->input = p;
+    return true;
+}
+
+static int find_condition(nfa_parser_state_t *state, const char *name, size_t length)
+{
+    for (int c = 0; c < state->conditions.length; ++c)
+    {
+        if (strlen(state->conditions.data[c]) == length && strncmp(state->conditions.data[c], name, length) == 0)
+        {
+            return c;
+        }
+    }
+    fprintf(stderr, "undeclared start condition '%.*s'\n", (int)length, name);
+    exit(1);
+}
+
+static bitset_t *condition_prefix(nfa_parser_state_t *state)
+{
+    // <A,B>pattern or <*>pattern; a '<' that doesn't open a well-formed list
+    // is an ordinary character
+    const char *p = state->input;
+    if ((state->flags & REGEX_PATTERN) || state->in_quote || state->current_token != tok_literal ||
+        state->current_lexeme != '<')
+    {
+        return NULL;
+    }
+    while (isalnum((unsigned char)*p) || *p == '_' || *p == ',' || *p == '*')
+    {
+        ++p;
+    }
+    if (*p != '>' || p == state->input)
+    {
+        return NULL;
+    }
+    bitset_t *conditions = bitset_create();
+    for (const char *name = state->input; name < p;)
+    {
+        const char *end = name;
+        while (end < p && *end != ',')
+        {
+            ++end;
+        }
+        if (end - name == 1 && *name == '*')
+        {
+            for (int c = 0; c < state->conditions.length; ++c)
+            {
+                bitset_set(conditions, c);
+            }
+        }
+        else
+        {
+            bitset_set(conditions, find_condition(state, name, end - name));
+        }
+        name = end + 1;
+    }
+    state->input = p + 1;
+    advance(state);
+    return conditions;
 }
 
 static nfa_node_t *rule(nfa_parser_state_t *state)
@@ -232,17 +529,22 @@ static nfa_node_t *rule(nfa_parser_state_t *state)
     nfa_node_t *start = NULL;
     nfa_node_t *end = NULL;
     int anchor = ANCHOR_NONE;
+    rule_t r;
+    memset(&r, 0, sizeof(rule_t));
     if (state->current_token == tok_carat)
     {
         start = alloc_nfa(state);
         start->edge = '\n';
         anchor |= ANCHOR_BOL;
         advance(state);
-        expr(state, &start->next[0], &end);
     }
-    else
+    ast_t *ast = ast_simplify(expr(state));
+    ast_build(state, ast, start ? &start->next[0] : &start, &end);
+    ast_free(ast);
+
+    if (state->current_token == tok_slash)
     {
-        expr(state, &start, &end);
+        trailing_context(state, &end, &r);
     }
 
     if (state->current_token == tok_dollar)
@@ -258,45 +560,84 @@ static nfa_node_t *rule(nfa_parser_state_t *state)
     }
 
     end->anchor = anchor;
+    r.start = start;
+    r.end = end;
+    r.anchor = anchor;
+    if (state->action)
+    {
+        r.action = copy_string(state->action, state->action_length);
+        state->action = NULL;
+    }
+    vec_push(&state->rules, r);
+    end->accept = state->rules.length;
     advance(state);
     return start;
 }
 
-static void expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr)
+static void trailing_context(nfa_parser_state_t *state, nfa_node_t **eptr, rule_t *r)
 {
-    cat_expr(state, sptr, eptr);
-    while (state->current_token == tok_pipe)
+    // r/s: the end of r stays in the graph as the junction, and s is built
+    // a second time right to left so the scanner can walk back from the end
+    // of a match to the junction without rescanning the token
+    advance(state);
+    ast_t *ast = ast_simplify(expr(state));
+    if (state->current_token == tok_slash)
     {
-        advance(state);
-        nfa_node_t *e2_start;
-        nfa_node_t *e2_end;
-        cat_expr(state, &e2_start, &e2_end);
-        nfa_node_t *p = alloc_nfa(state);
-        p->next[1] = e2_start;
-        p->next[0] = *sptr;
-        *sptr = p;
-        p = alloc_nfa(state);
-        (*eptr)->next[0] = p;
-        e2_end->next[0] = p;
-        *eptr = p;
+        fprintf(stderr, "a rule may only have one trailing context\n");
+        exit(1);
     }
+    nfa_node_t *s_start;
+    nfa_node_t *s_end;
+    ast_build(state, ast, &s_start, &s_end);
+    r->junction = *eptr;
+    r->junction->next[0] = s_start;
+    *eptr = s_end;
+
+    nfa_parser_state_t tail;
+    nfa_parser_state_init(&tail, state->input, state->flags);
+    tail.reverse = true;
+    nfa_node_t *t_start;
+    nfa_node_t *t_end;
+    ast_build(&tail, ast, &t_start, &t_end);
+    ast_free(ast);
+    t_end->accept = 1;
+    r->tail = make_nfa(&tail, t_start);
+}
+
+static ast_t *ast_new(ast_kind_t kind)
+{
+    ast_t *ast = calloc(1, sizeof(ast_t));
+    ast->kind = kind;
+    vec_init(&ast->children);
+    return ast;
 }
 
-static void cat_expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr)
+static ast_t *ast_unary(ast_kind_t kind, ast_t *child)
 {
-    if (first_in_cat(state->current_token))
+    ast_t *ast = ast_new(kind);
+    vec_push(&ast->children, child);
+    return ast;
+}
+
+static ast_t *expr(nfa_parser_state_t *state)
+{
+    ast_t *ast = ast_unary(AST_ALT, cat_expr(state));
+    while (state->current_token == tok_pipe)
     {
-        factor(state, sptr, eptr);
+        advance(state);
+        vec_push(&ast->children, cat_expr(state));
     }
+    return ast;
+}
+
+static ast_t *cat_expr(nfa_parser_state_t *state)
+{
+    ast_t *ast = ast_new(AST_CAT);
     while (first_in_cat(state->current_token))
     {
-        nfa_node_t *e2_start;
-        nfa_node_t *e2_end;
-        factor(state, &e2_start, &e2_end);
-        memcpy(*eptr, e2_start, sizeof(nfa_node_t));
-        discard_nfa(state, e2_start);
-        *eptr = e2_end;
+        vec_push(&ast->children, factor(state));
     }
+    return ast;
 }
 
 static bool first_in_cat(regex_token_t token)
@@ -306,6 +647,8 @@ static bool first_in_cat(regex_token_t token)
     case tok_right_paren:
     case tok_dollar:
     case tok_pipe:
+    case tok_slash:
+    case tok_newline:
     case tok_eoi:
         return false;
     case tok_star:
@@ -328,36 +671,44 @@ static bool first_in_cat(regex_token_t token)
     }
 }
 
-static void factor(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr)
+static ast_t *factor(nfa_parser_state_t *state)
 {
-    term(state, sptr, eptr);
-    if (state->current_token == tok_star || state->current_token == tok_plus ||
-        state->current_token == tok_question_mark)
+    ast_t *ast = term(state);
+    switch (state->current_token)
     {
-        nfa_node_t *start = alloc_nfa(state);
-        nfa_node_t *end = alloc_nfa(state);
-        start->next[0] = *sptr;
-        (*eptr)->next[0] = end;
-        if (state->current_token == tok_star || state->current_token == tok_question_mark)
-        {
-            start->next[1] = end;
-        }
-        if (state->current_token == tok_star || state->current_token == tok_plus)
-        {
-            (*eptr)->next[1] = *sptr;
-        }
-        *sptr = start;
-        *eptr = end;
-        advance(state);
+    case tok_star:
+        ast = ast_unary(AST_STAR, ast);
+        break;
+    case tok_plus:
+        ast = ast_unary(AST_PLUS, ast);
+        break;
+    case tok_question_mark:
+        ast = ast_unary(AST_QUESTION, ast);
+        break;
+    default:
+        return ast;
     }
+    advance(state);
+    return ast;
 }
 
-static void term(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr)
+static ast_t *term(nfa_parser_state_t *state)
 {
     if (state->current_token == tok_left_paren)
     {
+        int flags = state->flags;
+        int group = 0;
         advance(state);
-        expr(state, sptr, eptr);
+        if (state->current_token == tok_question_mark)
+        {
+            state->flags = group_flags(state);
+        }
+        else
+        {
+            group = ++state->groups;
+        }
+        ast_t *ast = expr(state);
+        state->flags = flags;
         if (state->current_token == tok_right_paren)
         {
             advance(state);
@@ -367,799 +718,7956 @@ static void term(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr
             fprintf(stderr, "Expected ')'");
             exit(1);
         }
+        if (group)
+        {
+            ast = ast_unary(AST_GROUP, ast);
+            ast->group = group;
+        }
+        return ast;
+    }
+
+    if (state->current_token != tok_dot && state->current_token != tok_left_bracket)
+    {
+        ast_t *ast;
+        if ((state->flags & REGEX_FOLD_CASE) && isalpha((unsigned char)state->current_lexeme))
+        {
+            // a folded literal is the two-member class [xX], so the DFA
+            // gets no more states than the case-sensitive pattern would
+            ast = ast_new(AST_CLASS);
+            ast->set = bitset_create();
+            bitset_set(ast->set, tolower((unsigned char)state->current_lexeme));
+            bitset_set(ast->set, toupper((unsigned char)state->current_lexeme));
+        }
+        else
+        {
+            ast = ast_new(AST_CHAR);
+            ast->c = state->current_lexeme;
+        }
+        advance(state);
+        return ast;
+    }
+
+    ast_t *ast = ast_new(AST_CLASS);
+    ast->set = bitset_create();
+    if (state->current_token == tok_dot)
+    {
+        bitset_set(ast->set, '\n');
+        bitset_set(ast->set, '\r');
+        ast->complement = true;
     }
     else
     {
-        nfa_node_t *start = alloc_nfa(state);
-        *sptr = start;
-        *eptr = start->next[0] = alloc_nfa(state);
-        if (state->current_token != tok_dot && state->current_token != tok_left_bracket)
+        state->in_class = true;
+        advance(state);
+        if (state->current_token == tok_carat)
         {
-            start->edge = state->current_lexeme;
             advance(state);
+            bitset_set(ast->set, '\n');
+            bitset_set(ast->set, '\r');
+            ast->complement = true;
+        }
+        if (state->current_token != tok_right_bracket)
+        {
+            do_dash(state, ast->set);
         }
         else
         {
-            start->edge = EDGE_CHARACTER_CLASS;
-            start->bitset = bitset_create();
-            if (state->current_token == tok_dot)
-            {
-                bitset_set(start->bitset, '\n');
-                bitset_set(start->bitset, '\r');
-                start->complement = true;
-            }
-            else
+            for (char c = 0; c <= ' '; ++c)
             {
-                advance(state);
-                if (state->current_token == tok_carat)
-                {
-                    advance(state);
-                    bitset_set(start->bitset, '\n');
-                    bitset_set(start->bitset, '\r');
-                    start->complement = true;
-                }
-                if (state->current_token != tok_right_bracket)
-                {
-                    do_dash(state, start->bitset);
-                }
-                else
-                {
-                    for (char c = 0; c <= ' '; ++c)
-                    {
-                        bitset_set(start->bitset, c);
-                    }
-                }
+                bitset_set(ast->set, c);
             }
-            advance(state);
+        }
+        if (state->flags & REGEX_FOLD_CASE)
+        {
+            fold_case(ast->set);
         }
     }
+    state->in_class = false;
+    advance(state);
+    return ast;
 }
 
-static void do_dash(nfa_parser_state_t *state, bitset_t *bitset)
+static int group_flags(nfa_parser_state_t *state)
 {
-    register int first;
-    for (; state->current_token != tok_eoi && state->current_token != tok_right_bracket; advance(state))
+    // (?i:...) turns case folding on for the group, (?-i:...) turns it off
+    int flags = state->flags;
+    bool negate = false;
+    for (advance(state); state->current_token != tok_eoi; advance(state))
     {
-        if (state->current_token != tok_dash)
+        if (state->current_token == tok_dash)
         {
-            first = state->current_lexeme;
-            bitset_set(bitset, first);
+            negate = true;
         }
-        else
+        else if (state->current_token == tok_literal && state->current_lexeme == 'i')
+        {
+            flags = negate ? flags & ~REGEX_FOLD_CASE : flags | REGEX_FOLD_CASE;
+        }
+        else if (state->current_token == tok_literal && state->current_lexeme == ':')
         {
             advance(state);
-            for (; first <= state->current_lexeme; ++first)
-            {
-                bitset_set(bitset, first);
-            }
+            return flags;
+        }
+        else
+        {
+            fprintf(stderr, "unknown group flag '%c'\n", state->current_lexeme);
+            exit(1);
         }
     }
+    fprintf(stderr, "Expected ':'");
+    exit(1);
 }
 
-static void ccl_print(bitset_t *set)
+static void fold_case(bitset_t *set)
 {
-    putchar('[');
-    for (int i = 0; i < 0x7F; ++i)
+    for (int c = 'a'; c <= 'z'; ++c)
     {
-        if (bitset_get(set, i))
+        if (bitset_get(set, c) || bitset_get(set, toupper(c)))
         {
-            if (i < ' ')
-            {
-                printf("^%c", i + '@');
-            }
-            else
-            {
-                printf("%c", i);
-            }
+            bitset_set(set, c);
+            bitset_set(set, toupper(c));
         }
     }
-    putchar(']');
 }
 
-static void nfa_print(nfa_t *nfa)
+static void do_dash(nfa_parser_state_t *state, bitset_t *bitset)
 {
-    for (int i = 0; i < nfa->nfa.length; i++)
+    register int first;
+    for (; state->current_token != tok_eoi && state->current_token != tok_right_bracket; advance(state))
     {
-        printf("NFA state %02d: ", nfa->nfa.data[i]->index);
-        if (nfa->nfa.data[i]->next[0] == NULL)
+        if (state->current_token != tok_dash)
         {
-            printf("(TERMINAL)");
+            first = state->current_lexeme;
+            bitset_set(bitset, first);
         }
         else
         {
-            printf("--> %02d ", nfa->nfa.data[i]->next[0]->index);
-            printf("(%02d) on ", nfa->nfa.data[i]->next[1] ? nfa->nfa.data[i]->next[1]->index : -1);
-            switch (nfa->nfa.data[i]->edge)
+            advance(state);
+            for (; first <= state->current_lexeme; ++first)
             {
-            case EDGE_CHARACTER_CLASS:
-                ccl_print(nfa->nfa.data[i]->bitset);
-                break;
-            case EDGE_EPSILON:
-                printf("EPSILON ");
-                break;
-            default:
-                printf("'%c'", nfa->nfa.data[i]->edge);
-                break;
+                bitset_set(bitset, first);
             }
         }
-
-        if (i == nfa->start)
-        {
-            printf(" (START STATE)");
-        }
-        printf("\n");
     }
 }
 
-static nfa_t *thompson(const char *input)
+static void ast_release(ast_t *ast)
 {
-    nfa_parser_state_t state;
-    state.input = input;
-    state.input_start = input;
-    vec_init(&state.nfa);
-    state.in_quote = false;
-    vec_init(&state.discard_stack);
-    nfa_t *out = GC_malloc(sizeof(nfa_t));
-    out->start = machine(&state)->index;
-    out->nfa = state.nfa;
-    vec_deinit(&state.discard_stack);
-    for (int i = 0; i < out->nfa.length; ++i)
+    // frees the node but not its operands
+    vec_deinit(&ast->children);
+    if (ast->set)
     {
-        if (out->nfa.data[i])
-        {
-            out->nfa.data[i]->index = i;
-        }
+        bitset_free(ast->set);
     }
-    return out;
+    free(ast);
 }
 
-void nfa_free(nfa_t *nfa)
+static void ast_free(ast_t *ast)
 {
-    for (int i = 0; i < nfa->nfa.length; ++i)
+    for (int i = 0; i < ast->children.length; ++i)
     {
-        if (nfa->nfa.data[i])
-        {
-            bitset_free(nfa->nfa.data[i]->bitset);
-        }
+        ast_free(ast->children.data[i]);
     }
-    vec_deinit(&nfa->nfa);
+    ast_release(ast);
 }
 
-typedef vec_t(bitset_t *) vec_bitset_t;
+static bool ast_atom(const ast_t *ast)
+{
+    return ast->kind == AST_CHAR || ast->kind == AST_CLASS;
+}
 
-typedef struct dfa_node_t
+static void ast_members(const ast_t *ast, bool members[0x100])
 {
-    bitset_t *bitset;
-    char id;
-    vec_t(struct dfa_node_t *) next;
-    vec_bitset_t chars;
-    int partition;
-    int index;
-} dfa_node_t;
+    for (int c = 0; c < 0x100; ++c)
+    {
+        members[c] = ast->kind == AST_CHAR ? (unsigned char)ast->c == c : bitset_get(ast->set, c) != ast->complement;
+    }
+}
 
-static dfa_node_t *epsilon_closure(nfa_t *nfa, bitset_t *input)
+static bool ast_same_atom(const ast_t *a, const ast_t *b)
 {
-    vec_int_t stack;
-    vec_init(&stack);
+    if (!ast_atom(a) || !ast_atom(b))
+    {
+        return false;
+    }
+    if (a->kind == AST_CHAR && b->kind == AST_CHAR)
+    {
+        return a->c == b->c;
+    }
+    bool x[0x100];
+    bool y[0x100];
+    ast_members(a, x);
+    ast_members(b, y);
+    return memcmp(x, y, sizeof(x)) == 0;
+}
 
-    for (int i = 0; i < nfa->nfa.length; ++i)
+static ast_t *ast_merge_atoms(ast_t **atoms, int count)
+{
+    // a|b|[c-e] is the one class [a-e]; if any member is complemented the
+    // union is stored as the complement of what it leaves out
+    bool members[0x100] = {false};
+    bool complement = false;
+    for (int i = 0; i < count; ++i)
     {
-        if (bitset_get(input, i))
+        bool m[0x100];
+        ast_members(atoms[i], m);
+        for (int c = 0; c < 0x100; ++c)
         {
-            vec_push(&stack, i);
+            members[c] |= m[c];
         }
+        complement |= atoms[i]->kind == AST_CLASS && atoms[i]->complement;
+        ast_free(atoms[i]);
     }
-
-    while (stack.length > 0)
+    ast_t *ast = ast_new(AST_CLASS);
+    ast->set = bitset_create();
+    ast->complement = complement;
+    for (int c = 0; c < 0x100; ++c)
     {
-        int i = vec_pop(&stack);
-        nfa_node_t *p = nfa->nfa.data[i];
-        if (p->edge == EDGE_EPSILON)
+        if (members[c] != complement)
         {
-            for (int j = 0; j <= 1; ++j)
-            {
-                if (p->next[j])
-                {
-                    i = p->next[j]->index;
-                    if (!bitset_get(input, i))
-                    {
-                        bitset_set(input, i);
-                        vec_push(&stack, i);
-                    }
-                }
-            }
+            bitset_set(ast->set, c);
         }
     }
-    vec_deinit(&stack);
-    dfa_node_t *dfa_node = GC_malloc(sizeof(dfa_node_t));
-    dfa_node->bitset = input;
-    vec_init(&dfa_node->next);
-    vec_init(&dfa_node->chars);
-    return dfa_node;
+    return ast;
 }
 
-static dfa_node_t *move(nfa_t *nfa, bitset_t *input, char c)
+static ast_t *ast_rewrite(ast_t *ast);
+
+static ast_t *ast_edge(ast_t *ast, bool last)
 {
-    bitset_t *outset = NULL;
-    for (int i = nfa->nfa.length - 1; i >= 0; --i)
+    // the first (or last) factor of a branch
+    if (ast->kind != AST_CAT)
     {
-        if (bitset_get(input, i))
-        {
-            nfa_node_t *p = nfa->nfa.data[i];
-            if (p->edge == c || p->edge == EDGE_CHARACTER_CLASS && (p->complement != bitset_get(p->bitset, c)))
-            {
-                if (!outset)
-                {
-                    outset = bitset_create();
-                }
-                bitset_set(outset, p->next[0]->index);
-            }
-        }
+        return ast;
     }
-    dfa_node_t *dfa_node = GC_malloc(sizeof(dfa_node_t));
-    dfa_node->bitset = outset;
-    vec_init(&dfa_node->next);
-    vec_init(&dfa_node->chars);
-    return dfa_node;
+    return last ? vec_last(&ast->children) : ast->children.data[0];
 }
 
-typedef vec_t(dfa_node_t *) dfa_t;
-
-static dfa_t *nfa_to_dfa(nfa_t *nfa)
+static ast_t *ast_strip(ast_t *ast, bool last)
 {
-    bitset_t *init = bitset_create();
-    bitset_set(init, nfa->start);
-    dfa_node_t *d0 = epsilon_closure(nfa, init);
-    dfa_t *dfa = GC_malloc(sizeof(dfa_t));
-    dfa_t work;
-    vec_init(dfa);
-    vec_init(&work);
-    vec_push(dfa, d0);
-    vec_push(&work, d0);
-    char id = 'A';
-    while (work.length > 0)
+    // what is left of a branch once ast_edge is taken off it. the edge
+    // itself is not freed
+    if (ast->kind != AST_CAT)
     {
-        dfa_node_t *di = vec_pop(&work);
-        di->id = id;
-        for (char c = 1; c < 0x7F; ++c)
-        {
-            dfa_node_t *dj = move(nfa, di->bitset, c);
-            if (dj->bitset)
-            {
-                dfa_node_t *s = epsilon_closure(nfa, dj->bitset);
-                dj = s;
-                bool unique = true;
-                bool in_next = false;
-                for (int i = 0; i < dfa->length; ++i)
-                {
-                    if (bitset_equals(dfa->data[i]->bitset, dj->bitset))
-                    {
-                        unique = false;
-                        for (int j = 0; j < di->next.length; ++j)
-                        {
-                            if (di->next.data[j] == dfa->data[i])
-                            {
-                                in_next = true;
-                                bitset_set(di->chars.data[j], c);
-                                break;
-                            }
-                        }
-                        if (!in_next)
-                        {
-                            vec_push(&di->next, dfa->data[i]);
-                        }
-                        dj->id = i + 'A';
-                        break;
-                    }
-                }
-                if (!in_next)
-                {
-                    bitset_t *b = bitset_create();
-                    bitset_set(b, c);
-                    vec_push(&di->chars, b);
-                }
-                if (unique)
-                {
-                    vec_push(&di->next, dj);
-                    vec_push(dfa, dj);
-                    vec_push(&work, dj);
-                }
-                else
-                {
-                    if (dj->bitset)
-                    {
-                        bitset_free(dj->bitset);
-                    }
-                }
-            }
-            else
-            {
-                // final state
-                if (dj->bitset)
-                {
-                    bitset_free(dj->bitset);
-                }
-            }
-        }
-        ++id;
+        return ast_new(AST_EMPTY);
     }
-    for (int i = 0; i < dfa->length; ++i)
+    if (last)
     {
-        dfa->data[i]->index = i;
+        vec_pop(&ast->children);
     }
-    return dfa;
+    else
+    {
+        vec_splice(&ast->children, 0, 1);
+    }
+    return ast_rewrite(ast);
 }
 
-static void dfa_to_dot(const dfa_t *dfa)
+static void ast_factor(ast_t *ast, bool last)
 {
-    printf("digraph test {\n");
-    for (int i = 0; i < dfa->length; ++i)
+    // ab|ac becomes a(b|c) and ax|bx becomes (a|b)x. only adjacent branches
+    // are factored, so their order (and which one a tag sees first) is kept
+    for (int i = 0; i < ast->children.length; ++i)
     {
-        const dfa_node_t *di = dfa->data[i];
-        for (int j = 0; j < di->next.length; ++j)
+        ast_t *edge = ast_edge(ast->children.data[i], last);
+        int j = i + 1;
+        while (j < ast->children.length && ast_same_atom(edge, ast_edge(ast->children.data[j], last)))
         {
-            const dfa_node_t *dj = di->next.data[j];
-            printf("%c -> %c [ label = \"'", di->id, dj->id);
-            bitset_t *b = di->chars.data[j];
-            for (char c = 0; c < 0x7F; ++c)
+            ++j;
+        }
+        if (j - i < 2)
+        {
+            continue;
+        }
+        ast_t *rest = ast_new(AST_ALT);
+        for (int k = i; k < j; ++k)
+        {
+            ast_t *branch = ast->children.data[k];
+            ast_t *e = ast_edge(branch, last);
+            vec_push(&rest->children, ast_strip(branch, last));
+            if (e != edge)
             {
-                if (bitset_get(b, c))
-                {
-                    if (c == '\'' || c == '"' || c == '\\')
-                    {
-                        printf("\\");
-                    }
-                    if (c < ' ')
-                    {
-                        printf("^%c", c + '@');
-                    }
-                    else
-                    {
-                        printf("%c", c);
-                    }
-                }
+                ast_free(e);
             }
-            printf("'\" ]\n");
         }
-        // if (di->next.length == 0) {
-        //   printf("%c is an accepting state\n", di->id);
-        // }
+        ast_t *cat = ast_new(AST_CAT);
+        vec_push(&cat->children, last ? ast_rewrite(rest) : edge);
+        vec_push(&cat->children, last ? edge : ast_rewrite(rest));
+        vec_splice(&ast->children, i + 1, j - i - 1);
+        ast->children.data[i] = ast_rewrite(cat);
     }
-    printf("}\n");
 }
 
-typedef vec_t(dfa_node_t *) partition_t;
-typedef vec_t(partition_t *) vec_partition_t;
-
-static dfa_node_t *do_goto(dfa_node_t *node, char c)
+static ast_t *ast_alt(ast_t *ast)
 {
-    for (int i = 0; i < node->chars.length; ++i)
+    vec_t(ast_t *) branches;
+    vec_init(&branches);
+    for (int i = 0; i < ast->children.length; ++i)
     {
-        if (bitset_get(node->chars.data[i], c))
+        ast_t *child = ast->children.data[i];
+        if (child->kind != AST_ALT)
         {
-            return node->next.data[i];
+            vec_push(&branches, child);
+            continue;
         }
+        vec_extend(&branches, &child->children);
+        ast_release(child);
     }
-    return NULL;
-}
 
-static bool dfa_nodes_equivalent(dfa_node_t *n1, dfa_node_t *n2)
-{
-    for (char c = 0; c < 0x7F; c++)
+    // runs of single-character branches become one class
+    ast->children.length = 0;
+    for (int i = 0; i < branches.length;)
     {
-        dfa_node_t *g1 = do_goto(n1, c);
-        dfa_node_t *g2 = do_goto(n2, c);
-        if (!g1 ^ !g2)
+        int j = i;
+        while (j < branches.length && ast_atom(branches.data[j]))
         {
-            return false;
+            ++j;
         }
-        if (g1 && g1->partition != g2->partition)
+        if (j - i >= 2)
         {
-            return false;
+            vec_push(&ast->children, ast_merge_atoms(&branches.data[i], j - i));
+            i = j;
+        }
+        else
+        {
+            vec_push(&ast->children, branches.data[i]);
+            ++i;
         }
     }
-    return true;
-}
+    vec_deinit(&branches);
 
-static dfa_t *minimize_dfa(dfa_t *dfa)
-{
-    // accepting, nonaccepting
-    // for each partition:
-    //  for each state in the partition:
-    //   move all states that are not equivalent to the first
-    //   to a new partition
-    vec_partition_t partitions;
-    vec_init(&partitions);
-    partition_t *p0 = GC_malloc(sizeof(partition_t));
-    vec_init(p0);
-    partition_t *p1 = GC_malloc(sizeof(partition_t));
-    vec_init(p1);
-    for (int i = 0; i < dfa->length; i++)
+    ast_factor(ast, false);
+    ast_factor(ast, true);
+
+    // a second empty branch can never be taken, and a|() is a?
+    bool empty = false;
+    for (int i = 0; i < ast->children.length;)
     {
-        if (dfa->data[i]->next.length == 0)
+        if (ast->children.data[i]->kind != AST_EMPTY)
+        {
+            ++i;
+        }
+        else if (empty)
         {
-            dfa->data[i]->partition = 0;
-            vec_push(p0, dfa->data[i]);
+            ast_free(ast->children.data[i]);
+            vec_splice(&ast->children, i, 1);
         }
         else
         {
-            dfa->data[i]->partition = 1;
-            vec_push(p1, dfa->data[i]);
+            empty = true;
+            ++i;
         }
     }
-    vec_push(&partitions, p0);
-    vec_push(&partitions, p1);
-    for (int i = 0; i < partitions.length; ++i)
+    if (ast->children.length > 1 && vec_last(&ast->children)->kind == AST_EMPTY)
     {
-        dfa_node_t *first = partitions.data[i]->data[0];
-        partition_t *new_partition = NULL;
-        for (int j = 0; j < partitions.data[i]->length; ++j)
+        ast_free(vec_pop(&ast->children));
+        return ast_rewrite(ast_unary(AST_QUESTION, ast_rewrite(ast)));
+    }
+    if (ast->children.length == 1)
+    {
+        ast_t *only = ast->children.data[0];
+        ast_release(ast);
+        return only;
+    }
+    return ast;
+}
+
+static ast_t *ast_rewrite(ast_t *ast)
+{
+    // simplifies one node whose operands are already simplified
+    switch (ast->kind)
+    {
+    case AST_CAT:
+    {
+        vec_t(ast_t *) factors;
+        vec_init(&factors);
+        for (int i = 0; i < ast->children.length; ++i)
         {
-            dfa_node_t *dij = partitions.data[i]->data[j];
-            if (dfa_nodes_equivalent(first, dij))
+            ast_t *child = ast->children.data[i];
+            if (child->kind == AST_CAT)
             {
-                continue;
+                vec_extend(&factors, &child->children);
+                ast_release(child);
+            }
+            else if (child->kind == AST_EMPTY)
+            {
+                ast_free(child);
             }
-            if (new_partition == NULL)
+            else
             {
-                new_partition = GC_malloc(sizeof(partition_t));
-                vec_init(new_partition);
+                vec_push(&factors, child);
             }
-            vec_push(new_partition, dij);
-            dij->partition = partitions.length;
         }
-        if (new_partition != NULL)
+        ast->children.length = 0;
+        vec_extend(&ast->children, &factors);
+        vec_deinit(&factors);
+        if (ast->children.length == 0)
         {
-            vec_push(&partitions, new_partition);
+            ast->kind = AST_EMPTY;
         }
-    }
-
-    vec_t(vec_int_t) pointers;
-    vec_init(&pointers);
-    for (int i = 0; i < partitions.length; ++i)
-    {
-        vec_int_t nx;
-        vec_init(&nx);
-        for (int j = 0; j < partitions.data[i]->data[0]->next.length; ++j)
+        else if (ast->children.length == 1)
         {
-            vec_push(&nx, partitions.data[i]->data[0]->next.data[j]->partition);
+            ast_t *only = ast->children.data[0];
+            ast_release(ast);
+            return only;
         }
-        vec_push(&pointers, nx);
+        return ast;
     }
-
-    dfa_t *new_dfa = GC_malloc(sizeof(dfa_t));
-    vec_init(new_dfa);
-    for (int i = 0; i < partitions.length; ++i)
+    case AST_ALT:
+        return ast_alt(ast);
+    case AST_STAR:
+    case AST_PLUS:
+    case AST_QUESTION:
     {
-        dfa_node_t *node = GC_malloc(sizeof(dfa_node_t));
-        dfa_node_t *old = partitions.data[i]->data[0];
-        node->index = i;
-        node->bitset = bitset_create();
-        node->id = i + 'A';
-        node->partition = i;
-        vec_init(&node->next);
-        vec_init(&node->chars);
-        for (int j = 0; j < old->chars.length; ++j)
+        // ()* is (), and (x*)*, (x+)?, (x?)+ and the like are all a single
+        // closure: x+ if both are +, x? if both are ?, and x* otherwise
+        ast_t *child = ast->children.data[0];
+        if (child->kind == AST_EMPTY)
         {
-            vec_push(&node->chars, bitset_copy(old->chars.data[j]));
+            ast_release(ast);
+            return child;
         }
-        vec_push(new_dfa, node);
-    }
-    for (int i = 0; i < partitions.length; ++i)
-    {
-        vec_deinit(partitions.data[i]);
-    }
-    vec_deinit(&partitions);
-    for (int i = 0; i < new_dfa->length; ++i)
-    {
-        for (int j = 0; j < pointers.data[i].length; ++j)
+        if (child->kind == AST_STAR || child->kind == AST_PLUS || child->kind == AST_QUESTION)
         {
-            vec_push(&new_dfa->data[i]->next, new_dfa->data[pointers.data[i].data[j]]);
+            child->kind = child->kind == ast->kind ? ast->kind : AST_STAR;
+            ast_release(ast);
+            return child;
         }
+        return ast;
+    }
+    default:
+        return ast;
     }
-    vec_deinit(&pointers);
-    return new_dfa;
 }
 
-static void emit_comment(const char *comment, ...)
+static ast_t *ast_simplify(ast_t *ast)
 {
-    va_list args;
-    va_start(args, comment);
-    while (comment)
+    for (int i = 0; i < ast->children.length; ++i)
     {
-        printf("// %s\n", comment);
-        comment = va_arg(args, const char *);
+        ast->children.data[i] = ast_simplify(ast->children.data[i]);
     }
-    va_end(args);
-}
-
-static void emit_yy_next(const char *name)
-{
-    emit_comment("yy_next(state, c) is given the current state and next character,", "and evaluates to the next state.",
-                 NULL);
-    printf("#define yy_next(state, c)    %s[state][c]\n", name);
+    return ast_rewrite(ast);
 }
 
-static void emit_dfa_state_table(const dfa_t *dfa)
+static void ast_build(nfa_parser_state_t *state, const ast_t *ast, nfa_node_t **sptr, nfa_node_t **eptr)
 {
-    printf("{\n");
-    printf("/* 00000 */ { ");
-    for (char c = 0; c < 0x7F; ++c)
+    switch (ast->kind)
     {
-        printf("   -1, ");
-    }
-    printf("},\n");
-    for (int i = 0; i < dfa->length; ++i)
+    case AST_EMPTY:
+    case AST_CHAR:
+    case AST_CLASS:
     {
-        dfa_node_t *node = dfa->data[i];
-        printf("/* %05d */ { ", i + 1);
-        for (char c = 0; c < 0x7F; ++c)
+        nfa_node_t *start = alloc_nfa(state);
+        *sptr = start;
+        *eptr = start->next[0] = alloc_nfa(state);
+        if (ast->kind == AST_CHAR)
+        {
+            start->edge = ast->c;
+        }
+        else if (ast->kind == AST_CLASS)
         {
-            bool found = false;
-            for (int j = 0; j < node->next.length; ++j)
+            start->edge = EDGE_CHARACTER_CLASS;
+            bitset_free(start->bitset);
+            start->bitset = bitset_copy(ast->set);
+            start->complement = ast->complement;
+            if (ast->complement)
             {
-                if (bitset_get(node->chars.data[j], c))
-                {
-                    found = true;
-                    printf("%5d, ", node->next.data[j]->index);
-                }
+                bitset_set(start->bitset, BYTE_OTHER);
             }
-            if (!found)
+        }
+        break;
+    }
+    case AST_CAT:
+        ast_build(state, ast->children.data[0], sptr, eptr);
+        for (int i = 1; i < ast->children.length; ++i)
+        {
+            // the end of one factor is overwritten with the start of the
+            // next, so concatenation costs no epsilon nodes
+            nfa_node_t *e2_start;
+            nfa_node_t *e2_end;
+            ast_build(state, ast->children.data[i], &e2_start, &e2_end);
+            if (state->reverse)
             {
-                printf("    0, ");
+                memcpy(e2_end, *sptr, sizeof(nfa_node_t));
+                discard_nfa(state, *sptr);
+                *sptr = e2_start;
+                continue;
             }
+            memcpy(*eptr, e2_start, sizeof(nfa_node_t));
+            discard_nfa(state, e2_start);
+            *eptr = e2_end;
         }
-        printf("},\n");
-    }
-    printf("};\n");
-}
-
-#define NCOLS 10
-#define TYPE "YY_TTYPE"
-#define STORAGE_CLASS "YYPRIVATE"
-#define DECODING_ROUTINE_STORAGE_CLASS "YYPRIVATE"
-#define INDENT "          "
-
-static void dfa_free(dfa_t *dfa)
-{
-    for (int i = 0; i < dfa->length; ++i)
+        break;
+    case AST_ALT:
+        ast_build(state, ast->children.data[0], sptr, eptr);
+        for (int i = 1; i < ast->children.length; ++i)
+        {
+            nfa_node_t *e2_start;
+            nfa_node_t *e2_end;
+            ast_build(state, ast->children.data[i], &e2_start, &e2_end);
+            nfa_node_t *p = alloc_nfa(state);
+            p->next[1] = e2_start;
+            p->next[0] = *sptr;
+            *sptr = p;
+            p = alloc_nfa(state);
+            (*eptr)->next[0] = p;
+            e2_end->next[0] = p;
+            *eptr = p;
+        }
+        break;
+    case AST_STAR:
+    case AST_PLUS:
+    case AST_QUESTION:
     {
-        for (int j = 0; j < dfa->data[i]->chars.length; ++j)
+        // next[0] is the preferred edge, so entering or repeating the body
+        // comes before leaving it and the closures are greedy
+        ast_build(state, ast->children.data[0], sptr, eptr);
+        nfa_node_t *start = alloc_nfa(state);
+        nfa_node_t *end = alloc_nfa(state);
+        start->next[0] = *sptr;
+        if (ast->kind != AST_PLUS)
         {
-            bitset_free(dfa->data[i]->chars.data[j]);
+            start->next[1] = end;
         }
-        bitset_free(dfa->data[i]->bitset);
-        vec_deinit(&dfa->data[i]->chars);
-        vec_deinit(&dfa->data[i]->next);
-    }
-    vec_deinit(dfa);
+        if (ast->kind != AST_QUESTION)
+        {
+            (*eptr)->next[0] = *sptr;
+            (*eptr)->next[1] = end;
+        }
+        else
+        {
+            (*eptr)->next[0] = end;
+        }
+        *sptr = start;
+        *eptr = end;
+        break;
+    }
+    case AST_GROUP:
+        ast_build(state, ast->children.data[0], sptr, eptr);
+        if (!state->reverse)
+        {
+            // epsilon nodes carrying the group's tags. the close tag is
+            // followed by a plain end node, since concatenation overwrites
+            // the end of a factor with the start of the next one
+            nfa_node_t *open = alloc_nfa(state);
+            nfa_node_t *close = alloc_nfa(state);
+            open->tag = 2 * ast->group - 1;
+            open->next[0] = *sptr;
+            close->tag = 2 * ast->group;
+            (*eptr)->next[0] = close;
+            close->next[0] = alloc_nfa(state);
+            *sptr = open;
+            *eptr = close->next[0];
+        }
+        break;
+    }
+}
+
+static void ccl_print(bitset_t *set)
+{
+    putchar('[');
+    for (int i = 0; i < 0x7F; ++i)
+    {
+        if (bitset_get(set, i))
+        {
+            if (i < ' ')
+            {
+                printf("^%c", i + '@');
+            }
+            else
+            {
+                printf("%c", i);
+            }
+        }
+    }
+    putchar(']');
+}
+
+static void nfa_print(nfa_t *nfa)
+{
+    for (int i = 0; i < nfa->nfa.length; i++)
+    {
+        printf("NFA state %02d: ", nfa->nfa.data[i]->index);
+        if (nfa->nfa.data[i]->next[0] == NULL)
+        {
+            printf("(TERMINAL)");
+        }
+        else
+        {
+            printf("--> %02d ", nfa->nfa.data[i]->next[0]->index);
+            printf("(%02d) on ", nfa->nfa.data[i]->next[1] ? nfa->nfa.data[i]->next[1]->index : -1);
+            switch (nfa->nfa.data[i]->edge)
+            {
+            case EDGE_CHARACTER_CLASS:
+                ccl_print(nfa->nfa.data[i]->bitset);
+                break;
+            case EDGE_EPSILON:
+                printf("EPSILON ");
+                break;
+            default:
+                printf("'%c'", nfa->nfa.data[i]->edge);
+                break;
+            }
+        }
+
+        if (i == nfa->start)
+        {
+            printf(" (START STATE)");
+        }
+        printf("\n");
+    }
+}
+
+static int fragment_length(nfa_t *nfa, nfa_node_t *from, nfa_node_t *to)
+{
+    // the number of characters every path from `from` to `to` consumes,
+    // or -1 if two paths disagree (which includes any loop)
+    vec_int_t dist;
+    vec_int_t stack;
+    vec_init(&dist);
+    vec_init(&stack);
+    for (int i = 0; i < nfa->nfa.length; ++i)
+    {
+        vec_push(&dist, -1);
+    }
+    dist.data[from->index] = 0;
+    vec_push(&stack, from->index);
+    int length = 0;
+    while (stack.length > 0 && length >= 0)
+    {
+        nfa_node_t *p = nfa->nfa.data[vec_pop(&stack)];
+        if (p == to)
+        {
+            continue;
+        }
+        int d = dist.data[p->index] + (p->edge == EDGE_EPSILON ? 0 : 1);
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j] == NULL)
+            {
+                continue;
+            }
+            int i = p->next[j]->index;
+            if (dist.data[i] == -1)
+            {
+                dist.data[i] = d;
+                vec_push(&stack, i);
+            }
+            else if (dist.data[i] != d)
+            {
+                length = -1;
+            }
+        }
+    }
+    if (length == 0)
+    {
+        length = dist.data[to->index];
+    }
+    vec_deinit(&stack);
+    vec_deinit(&dist);
+    return length;
+}
+
+static nfa_t *make_nfa(nfa_parser_state_t *state, nfa_node_t *start)
+{
+    nfa_t *out = GC_malloc(sizeof(nfa_t));
+    out->nfa = state->nfa;
+    out->rules = state->rules;
+    vec_deinit(&state->discard_stack);
+    for (int i = 0; i < out->nfa.length; ++i)
+    {
+        if (out->nfa.data[i])
+        {
+            out->nfa.data[i]->index = i;
+        }
+    }
+    out->start = start->index;
+    out->conditions = state->conditions;
+    out->groups = state->groups;
+    vec_init(&out->starts);
+    for (int i = 0; i < state->entries.length; ++i)
+    {
+        vec_push(&out->starts, state->entries.data[i]->index);
+    }
+    if (out->starts.length == 0)
+    {
+        vec_push(&out->starts, out->start);
+    }
+    vec_deinit(&state->entries);
+    vec_deinit(&state->exclusive);
+    for (int i = 0; i < out->rules.length; ++i)
+    {
+        rule_t *r = &out->rules.data[i];
+        if (!r->junction)
+        {
+            continue;
+        }
+        int tail = fragment_length(out, r->junction, r->end);
+        int head = fragment_length(out, r->start, r->junction);
+        if (tail >= 0)
+        {
+            r->trail = TRAIL_FIXED_TAIL;
+            r->trail_length = tail;
+        }
+        else if (head >= 0)
+        {
+            r->trail = TRAIL_FIXED_HEAD;
+            r->trail_length = head;
+        }
+        else
+        {
+            r->trail = TRAIL_VARIABLE;
+        }
+    }
+    return out;
+}
+
+static nfa_t *thompson(const char *input, int flags)
+{
+    nfa_parser_state_t state;
+    nfa_parser_state_init(&state, input, flags);
+    return make_nfa(&state, machine(&state));
+}
+
+static ast_t *pattern_ast(const char *input, int flags)
+{
+    // the simplified tree of a single pattern, for planners that look at
+    // its literal structure. anchors are dropped and r/s reads as rs
+    nfa_parser_state_t state;
+    nfa_parser_state_init(&state, input, flags);
+    advance(&state);
+    if (state.current_token == tok_carat)
+    {
+        advance(&state);
+    }
+    ast_t *ast = expr(&state);
+    if (state.current_token == tok_slash)
+    {
+        advance(&state);
+        ast = ast_unary(AST_CAT, ast);
+        vec_push(&ast->children, expr(&state));
+    }
+    vec_deinit(&state.nfa);
+    vec_deinit(&state.discard_stack);
+    vec_deinit(&state.rules);
+    vec_deinit(&state.conditions);
+    vec_deinit(&state.exclusive);
+    vec_deinit(&state.entries);
+    return ast_simplify(ast);
+}
+
+void nfa_free(nfa_t *nfa)
+{
+    for (int i = 0; i < nfa->nfa.length; ++i)
+    {
+        if (nfa->nfa.data[i])
+        {
+            bitset_free(nfa->nfa.data[i]->bitset);
+        }
+    }
+    for (int i = 0; i < nfa->rules.length; ++i)
+    {
+        if (nfa->rules.data[i].tail)
+        {
+            nfa_free(nfa->rules.data[i].tail);
+        }
+        if (nfa->rules.data[i].conditions)
+        {
+            bitset_free(nfa->rules.data[i].conditions);
+        }
+        free(nfa->rules.data[i].action);
+    }
+    for (int i = 0; i < nfa->conditions.length; ++i)
+    {
+        free(nfa->conditions.data[i]);
+    }
+    vec_deinit(&nfa->conditions);
+    vec_deinit(&nfa->starts);
+    vec_deinit(&nfa->rules);
+    vec_deinit(&nfa->nfa);
+}
+
+static nfa_node_t *append_nfa(nfa_t *nfa)
+{
+    nfa_node_t *node = GC_malloc(sizeof(nfa_node_t));
+    memset(node, 0, sizeof(nfa_node_t));
+    node->bitset = bitset_create();
+    node->index = nfa->nfa.length;
+    vec_push(&nfa->nfa, node);
+    return node;
+}
+
+static nfa_node_t *any_loop(nfa_t *nfa, nfa_node_t *next)
+{
+    // an epsilon node that can consume any character and come back, or go
+    // on to next
+    nfa_node_t *loop = append_nfa(nfa);
+    nfa_node_t *any = append_nfa(nfa);
+    any->edge = EDGE_CHARACTER_CLASS;
+    any->complement = true;
+    any->next[0] = loop;
+    loop->next[0] = any;
+    loop->next[1] = next;
+    return loop;
+}
+
+static void nfa_search(nfa_t *nfa)
+{
+    // turns the machine for P into one for (any)*P(any)*, which accepts
+    // every text that contains a match
+    int length = nfa->nfa.length;
+    for (int i = 0; i < length; ++i)
+    {
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (p && p->accept)
+        {
+            nfa_node_t *end = append_nfa(nfa);
+            end->accept = p->accept;
+            p->accept = 0;
+            p->next[0] = any_loop(nfa, end);
+        }
+    }
+    nfa_node_t *start = any_loop(nfa, nfa->nfa.data[nfa->start]);
+    nfa->start = start->index;
+    nfa->starts.data[0] = start->index;
+}
+
+static void nfa_line_starts(nfa_t *nfa)
+{
+    // for the scanner, which knows from the byte before a token whether a
+    // line begins there instead of reading that newline. every condition
+    // gets a second entry, after all the first ones, that keeps its ^ rules;
+    // the first entry leaves them out. the ^ rules lose their newline node
+    bool anchored = false;
+    for (int r = 0; r < nfa->rules.length; ++r)
+    {
+        anchored |= (nfa->rules.data[r].anchor & ANCHOR_BOL) != 0;
+    }
+    if (!anchored)
+    {
+        return;
+    }
+    int conditions = nfa->starts.length;
+    for (int c = 0; c < conditions; ++c)
+    {
+        nfa_node_t *heads[2] = {append_nfa(nfa), append_nfa(nfa)};
+        nfa_node_t *tails[2] = {NULL, NULL};
+        for (nfa_node_t *p = nfa->nfa.data[nfa->starts.data[c]]; p && p->next[0]; p = p->next[1])
+        {
+            int r = 0;
+            while (nfa->rules.data[r].start != p->next[0])
+            {
+                ++r;
+            }
+            bool bol = nfa->rules.data[r].anchor & ANCHOR_BOL;
+            for (int e = bol ? 1 : 0; e < 2; ++e)
+            {
+                nfa_node_t *link = tails[e] ? (tails[e]->next[1] = append_nfa(nfa)) : heads[e];
+                link->next[0] = bol ? p->next[0]->next[0] : p->next[0];
+                tails[e] = link;
+            }
+        }
+        nfa->starts.data[c] = heads[0]->index;
+        vec_push(&nfa->starts, heads[1]->index);
+    }
+    for (int r = 0; r < nfa->rules.length; ++r)
+    {
+        rule_t *rule = &nfa->rules.data[r];
+        if (rule->anchor & ANCHOR_BOL)
+        {
+            rule->start = rule->start->next[0];
+            rule->trail_length -= rule->trail == TRAIL_FIXED_HEAD;
+        }
+    }
+    nfa->start = nfa->starts.data[0];
+}
+
+// how far a pattern may blow up in subset construction, guessed from the
+// NFA alone so a hostile pattern can be turned away before nfa_to_dfa
+#define DFA_STATE_BUDGET 0x1000
+#define DFA_MAX_STATES 0x4000
+#define DFA_MAX_BYTES ((size_t)1 << 28)
+
+typedef struct
+{
+    // nodes that consume a character
+    int positions;
+    // likely DFA states, and the bytes make_dtran would need for them
+    double states;
+    double bytes;
+} nfa_cost_t;
+
+// hard caps for nfa_to_dfa; 0 leaves one unbounded
+typedef struct
+{
+    size_t max_states;
+    size_t max_bytes;
+} dfa_limits_t;
+
+static const dfa_limits_t dfa_default_limits = {DFA_MAX_STATES, DFA_MAX_BYTES};
+
+static bool nfa_consumes(const nfa_node_t *p)
+{
+    return p->edge != EDGE_EPSILON && p->edge != EDGE_EMPTY;
+}
+
+static void nfa_node_chars(const nfa_node_t *p, uint64_t chars[2])
+{
+    // the characters a consuming node reads, as a 128-bit mask
+    chars[0] = chars[1] = 0;
+    for (int c = 1; c < 0x80; ++c)
+    {
+        bool reads = p->edge == EDGE_CHARACTER_CLASS ? p->complement != bitset_get(p->bitset, c)
+                                                     : p->edge == c && c != BYTE_OTHER;
+        if (reads)
+        {
+            chars[c >> 6] |= (uint64_t)1 << (c & 63);
+        }
+    }
+}
+
+static int nfa_components(const nfa_t *nfa, int *component)
+{
+    // strongly connected components (Tarjan), without recursion so a long
+    // pattern cannot overflow the stack. a node that has been numbered but
+    // has no component yet is still on the stack
+    int n = nfa->nfa.length;
+    int *order = malloc(n * sizeof(int));
+    int *low = malloc(n * sizeof(int));
+    int *cursor = calloc(n, sizeof(int));
+    vec_int_t stack;
+    vec_int_t calls;
+    vec_init(&stack);
+    vec_init(&calls);
+    for (int i = 0; i < n; ++i)
+    {
+        order[i] = -1;
+        component[i] = -1;
+    }
+    int count = 0;
+    int components = 0;
+    for (int root = 0; root < n; ++root)
+    {
+        if (!nfa->nfa.data[root] || order[root] >= 0)
+        {
+            continue;
+        }
+        order[root] = low[root] = count++;
+        vec_push(&stack, root);
+        vec_push(&calls, root);
+        while (calls.length > 0)
+        {
+            int v = vec_last(&calls);
+            if (cursor[v] < 2)
+            {
+                nfa_node_t *next = nfa->nfa.data[v]->next[cursor[v]++];
+                if (!next)
+                {
+                    continue;
+                }
+                int w = next->index;
+                if (order[w] < 0)
+                {
+                    order[w] = low[w] = count++;
+                    vec_push(&stack, w);
+                    vec_push(&calls, w);
+                }
+                else if (component[w] < 0 && order[w] < low[v])
+                {
+                    low[v] = order[w];
+                }
+                continue;
+            }
+            vec_pop(&calls);
+            if (low[v] == order[v])
+            {
+                int w;
+                do
+                {
+                    w = vec_pop(&stack);
+                    component[w] = components;
+                } while (w != v);
+                ++components;
+            }
+            if (calls.length > 0 && low[v] < low[vec_last(&calls)])
+            {
+                low[vec_last(&calls)] = low[v];
+            }
+        }
+    }
+    vec_deinit(&stack);
+    vec_deinit(&calls);
+    free(order);
+    free(low);
+    free(cursor);
+    return components;
+}
+
+static void nfa_level(const nfa_t *nfa, const int *component, int loop, bitset_t *visited, vec_int_t *from,
+                      vec_int_t *level)
+{
+    // the consuming nodes one character past the nodes in from, through
+    // epsilon edges, leaving out the loop and anything seen before
+    vec_int_t stack;
+    vec_init(&stack);
+    for (int i = 0; i < from->length; ++i)
+    {
+        nfa_node_t *p = nfa->nfa.data[from->data[i]];
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j])
+            {
+                vec_push(&stack, p->next[j]->index);
+            }
+        }
+    }
+    while (stack.length > 0)
+    {
+        int i = vec_pop(&stack);
+        if (component[i] == loop || bitset_get(visited, i))
+        {
+            continue;
+        }
+        bitset_set(visited, i);
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (nfa_consumes(p))
+        {
+            vec_push(level, i);
+            continue;
+        }
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j])
+            {
+                vec_push(&stack, p->next[j]->index);
+            }
+        }
+    }
+    vec_deinit(&stack);
+}
+
+static nfa_cost_t nfa_estimate(const nfa_t *nfa)
+{
+    // every position costs about one state. a closure costs more when what
+    // follows it can also be read by the closure itself: the DFA then has
+    // to track every position the text might have reached. walking out of
+    // the closure one character at a time, a step whose positions read a
+    // single character of the closure's set (a literal, as in .*abc) adds
+    // one state, and a step that reads two or more (a class, an
+    // alternation, as in .*a[ab][ab]) can double them
+    int n = nfa->nfa.length;
+    uint64_t(*chars)[2] = calloc(n ? n : 1, sizeof(*chars));
+    int *component = malloc((n ? n : 1) * sizeof(int));
+    int components = nfa_components(nfa, component);
+    int *size = calloc(components ? components : 1, sizeof(int));
+    uint64_t(*loop_chars)[2] = calloc(components ? components : 1, sizeof(*loop_chars));
+    nfa_cost_t cost = {0, 1, 0};
+    for (int i = 0; i < n; ++i)
+    {
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (!p)
+        {
+            continue;
+        }
+        ++size[component[i]];
+        if (!nfa_consumes(p))
+        {
+            continue;
+        }
+        ++cost.positions;
+        nfa_node_chars(p, chars[i]);
+        loop_chars[component[i]][0] |= chars[i][0];
+        loop_chars[component[i]][1] |= chars[i][1];
+    }
+    cost.states += cost.positions;
+
+    bitset_t *visited = bitset_create();
+    vec_int_t from;
+    vec_int_t level;
+    vec_init(&from);
+    vec_init(&level);
+    for (int loop = 0; loop < components; ++loop)
+    {
+        // a component of one node is no closure, since thompson never
+        // makes a node its own successor
+        if (size[loop] < 2 || !(loop_chars[loop][0] | loop_chars[loop][1]))
+        {
+            continue;
+        }
+        bitset_clear(visited);
+        vec_clear(&from);
+        for (int i = 0; i < n; ++i)
+        {
+            if (component[i] == loop)
+            {
+                vec_push(&from, i);
+            }
+        }
+        int narrow = 0;
+        int wide = 0;
+        while (from.length > 0 && wide < 62)
+        {
+            vec_clear(&level);
+            nfa_level(nfa, component, loop, visited, &from, &level);
+            vec_clear(&from);
+            uint64_t seen[2] = {0, 0};
+            for (int k = 0; k < level.length; ++k)
+            {
+                int i = level.data[k];
+                uint64_t overlap[2] = {chars[i][0] & loop_chars[loop][0], chars[i][1] & loop_chars[loop][1]};
+                if (overlap[0] | overlap[1])
+                {
+                    seen[0] |= overlap[0];
+                    seen[1] |= overlap[1];
+                    vec_push(&from, i);
+                }
+            }
+            int width = __builtin_popcountll(seen[0]) + __builtin_popcountll(seen[1]);
+            if (width > 1)
+            {
+                ++wide;
+            }
+            else if (width == 1)
+            {
+                ++narrow;
+            }
+        }
+        cost.states += (narrow + 1) * (double)((uint64_t)1 << wide);
+    }
+    cost.bytes = cost.states * 0x80 * sizeof(int);
+
+    vec_deinit(&from);
+    vec_deinit(&level);
+    bitset_free(visited);
+    free(loop_chars);
+    free(size);
+    free(component);
+    free(chars);
+    return cost;
+}
+
+// the characters lo..hi, inclusive, all lead to next
+typedef struct
+{
+    char lo;
+    char hi;
+    struct dfa_node_t *next;
+} dfa_range_t;
+
+typedef struct dfa_node_t
+{
+    bitset_t *bitset;
+    char id;
+    // sorted and disjoint; neighbouring ranges never share a target
+    vec_t(dfa_range_t) ranges;
+    int partition;
+    int index;
+    // lowest-numbered rule accepted here, 0 if none
+    int accept;
+    // rules with variable trailing context whose r can end here, or NULL
+    bitset_t *trail;
+    // start conditions that enter the machine here, or NULL
+    bitset_t *entry;
+} dfa_node_t;
+
+static dfa_node_t *epsilon_closure(nfa_t *nfa, bitset_t *input)
+{
+    vec_int_t stack;
+    vec_init(&stack);
+
+    for (size_t i = 0; bitset_next_set_bit(input, &i); ++i)
+    {
+        vec_push(&stack, i);
+    }
+
+    while (stack.length > 0)
+    {
+        int i = vec_pop(&stack);
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (p->edge == EDGE_EPSILON)
+        {
+            for (int j = 0; j <= 1; ++j)
+            {
+                if (p->next[j])
+                {
+                    i = p->next[j]->index;
+                    if (!bitset_get(input, i))
+                    {
+                        bitset_set(input, i);
+                        vec_push(&stack, i);
+                    }
+                }
+            }
+        }
+    }
+    vec_deinit(&stack);
+    dfa_node_t *dfa_node = GC_malloc(sizeof(dfa_node_t));
+    dfa_node->bitset = input;
+    vec_init(&dfa_node->ranges);
+    return dfa_node;
+}
+
+static dfa_node_t *move(nfa_t *nfa, bitset_t *input, char c)
+{
+    bitset_t *outset = NULL;
+    for (size_t i = 0; bitset_next_set_bit(input, &i); ++i)
+    {
+        nfa_node_t *p = nfa->nfa.data[i];
+        if ((p->edge == c && c != BYTE_OTHER) ||
+            (p->edge == EDGE_CHARACTER_CLASS && p->complement != bitset_get(p->bitset, c)))
+        {
+            if (!outset)
+            {
+                outset = bitset_create();
+            }
+            bitset_set(outset, p->next[0]->index);
+        }
+    }
+    dfa_node_t *dfa_node = GC_malloc(sizeof(dfa_node_t));
+    dfa_node->bitset = outset;
+    vec_init(&dfa_node->ranges);
+    return dfa_node;
+}
+
+typedef vec_t(dfa_node_t *) dfa_t;
+
+static dfa_node_t *do_goto(const dfa_node_t *node, char c)
+{
+    int lo = 0;
+    int hi = node->ranges.length;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (node->ranges.data[mid].hi < c)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo < node->ranges.length && node->ranges.data[lo].lo <= c)
+    {
+        return node->ranges.data[lo].next;
+    }
+    return NULL;
+}
+
+static void dfa_add_range(dfa_node_t *from, char lo, char hi, dfa_node_t *to)
+{
+    // lo..hi must not overlap a range that is already there. ranges mostly
+    // arrive in order, so the search starts from the end
+    int i = from->ranges.length;
+    while (i > 0 && from->ranges.data[i - 1].lo > hi)
+    {
+        --i;
+    }
+    dfa_range_t r = {lo, hi, to};
+    vec_insert(&from->ranges, i, r);
+    dfa_range_t *ranges = from->ranges.data;
+    if (i + 1 < from->ranges.length && ranges[i + 1].next == to && ranges[i + 1].lo == hi + 1)
+    {
+        ranges[i].hi = ranges[i + 1].hi;
+        vec_splice(&from->ranges, i + 1, 1);
+    }
+    if (i > 0 && ranges[i - 1].next == to && ranges[i - 1].hi + 1 == lo)
+    {
+        ranges[i - 1].hi = ranges[i].hi;
+        vec_splice(&from->ranges, i, 1);
+    }
+}
+
+static void dfa_add_edge(dfa_node_t *from, dfa_node_t *to, char c)
+{
+    dfa_add_range(from, c, c, to);
+}
+
+static void dfa_node_accept(nfa_t *nfa, dfa_node_t *node)
+{
+    for (size_t i = 0; bitset_next_set_bit(node->bitset, &i); ++i)
+    {
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (p->accept && (!node->accept || p->accept < node->accept))
+        {
+            node->accept = p->accept;
+        }
+    }
+    for (int i = 0; i < nfa->rules.length; ++i)
+    {
+        rule_t *r = &nfa->rules.data[i];
+        if (r->trail == TRAIL_VARIABLE && bitset_get(node->bitset, r->junction->index))
+        {
+            if (!node->trail)
+            {
+                node->trail = bitset_create();
+            }
+            bitset_set(node->trail, i + 1);
+        }
+    }
+}
+
+static void dfa_free(dfa_t *dfa);
+
+static size_t dfa_node_bytes(const nfa_t *nfa, const dfa_node_t *node)
+{
+    return sizeof(dfa_node_t) + (nfa->nfa.length / 64 + 1) * sizeof(uint64_t) +
+           node->ranges.capacity * sizeof(dfa_range_t);
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t bitset_hash(const bitset_t *set)
+{
+    // over the members, so equal sets hash alike however far they grew
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; bitset_next_set_bit(set, &i); ++i)
+    {
+        hash = fnv1a(hash, &i, sizeof(i));
+    }
+    return hash;
+}
+
+// the states of a subset construction by the hash of what they stand for,
+// so finding one is not a scan over all of them. slots hold a state number
+// plus one, 0 when empty; the caller compares the candidates
+typedef struct
+{
+    int *states;
+    uint64_t *hashes;
+    size_t size;
+    size_t count;
+} state_table_t;
+
+static void state_table_init(state_table_t *table)
+{
+    table->size = 0x400;
+    table->count = 0;
+    table->states = calloc(table->size, sizeof(int));
+    table->hashes = malloc(table->size * sizeof(uint64_t));
+}
+
+static void state_table_free(state_table_t *table)
+{
+    free(table->states);
+    free(table->hashes);
+}
+
+static int state_table_next(const state_table_t *table, uint64_t hash, size_t *slot)
+{
+    // the states with this hash, one per call starting from *slot =
+    // hash, then -1 with *slot at the empty slot a new state would take
+    for (*slot &= table->size - 1; table->states[*slot]; *slot = (*slot + 1) & (table->size - 1))
+    {
+        if (table->hashes[*slot] == hash)
+        {
+            int state = table->states[*slot] - 1;
+            *slot = (*slot + 1) & (table->size - 1);
+            return state;
+        }
+    }
+    return -1;
+}
+
+static void state_table_add(state_table_t *table, size_t slot, uint64_t hash, int state)
+{
+    // slot is where state_table_next stopped
+    table->states[slot] = state + 1;
+    table->hashes[slot] = hash;
+    if (2 * ++table->count <= table->size)
+    {
+        return;
+    }
+    size_t size = 2 * table->size;
+    int *states = calloc(size, sizeof(int));
+    uint64_t *hashes = malloc(size * sizeof(uint64_t));
+    for (size_t i = 0; i < table->size; ++i)
+    {
+        if (table->states[i])
+        {
+            size_t j = table->hashes[i] & (size - 1);
+            while (states[j])
+            {
+                j = (j + 1) & (size - 1);
+            }
+            states[j] = table->states[i];
+            hashes[j] = table->hashes[i];
+        }
+    }
+    state_table_free(table);
+    table->states = states;
+    table->hashes = hashes;
+    table->size = size;
+}
+
+static int dfa_find_state(const dfa_t *dfa, const state_table_t *table, const bitset_t *set, uint64_t hash,
+                          size_t *slot)
+{
+    // the DFA state for an NFA set, or -1
+    int i;
+    for (*slot = hash; (i = state_table_next(table, hash, slot)) >= 0;)
+    {
+        if (bitset_equals(dfa->data[i]->bitset, set))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+static dfa_t *nfa_to_dfa(nfa_t *nfa, const dfa_limits_t *limits)
+{
+    // with limits, NULL is returned as soon as the machine outgrows them
+    bitset_t *init = bitset_create();
+    bitset_set(init, nfa->start);
+    dfa_node_t *d0 = epsilon_closure(nfa, init);
+    dfa_node_accept(nfa, d0);
+    dfa_t *dfa = GC_malloc(sizeof(dfa_t));
+    dfa_t work;
+    vec_init(dfa);
+    vec_init(&work);
+    vec_push(dfa, d0);
+    vec_push(&work, d0);
+    state_table_t table;
+    state_table_init(&table);
+    size_t slot;
+    uint64_t hash = bitset_hash(d0->bitset);
+    dfa_find_state(dfa, &table, d0->bitset, hash, &slot);
+    state_table_add(&table, slot, hash, 0);
+    d0->entry = bitset_create();
+    bitset_set(d0->entry, 0);
+    for (int c = 1; c < nfa->starts.length; ++c)
+    {
+        // the other start conditions enter the same machine, sharing every
+        // state they can reach
+        bitset_t *set = bitset_create();
+        bitset_set(set, nfa->starts.data[c]);
+        dfa_node_t *dc = epsilon_closure(nfa, set);
+        hash = bitset_hash(dc->bitset);
+        int i = dfa_find_state(dfa, &table, dc->bitset, hash, &slot);
+        if (i >= 0)
+        {
+            bitset_free(dc->bitset);
+            dc = dfa->data[i];
+        }
+        else
+        {
+            dfa_node_accept(nfa, dc);
+            dc->entry = bitset_create();
+            state_table_add(&table, slot, hash, dfa->length);
+            vec_push(dfa, dc);
+            vec_push(&work, dc);
+        }
+        bitset_set(dc->entry, c);
+    }
+    size_t bytes = 0;
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        bytes += dfa_node_bytes(nfa, dfa->data[i]);
+    }
+    char id = 'A';
+    while (work.length > 0)
+    {
+        if (limits && ((limits->max_states && (size_t)dfa->length > limits->max_states) ||
+                       (limits->max_bytes && bytes > limits->max_bytes)))
+        {
+            vec_deinit(&work);
+            state_table_free(&table);
+            dfa_free(dfa);
+            return NULL;
+        }
+        dfa_node_t *di = vec_pop(&work);
+        di->id = id;
+        for (int c = 1; c <= BYTE_OTHER; ++c)
+        {
+            dfa_node_t *dj = move(nfa, di->bitset, c);
+            if (dj->bitset)
+            {
+                dfa_node_t *s = epsilon_closure(nfa, dj->bitset);
+                dj = s;
+                hash = bitset_hash(dj->bitset);
+                int i = dfa_find_state(dfa, &table, dj->bitset, hash, &slot);
+                if (i < 0)
+                {
+                    dfa_node_accept(nfa, dj);
+                    dfa_add_edge(di, dj, c);
+                    state_table_add(&table, slot, hash, dfa->length);
+                    vec_push(dfa, dj);
+                    vec_push(&work, dj);
+                    bytes += dfa_node_bytes(nfa, dj);
+                }
+                else
+                {
+                    dfa_add_edge(di, dfa->data[i], c);
+                    dj->id = i + 'A';
+                    bitset_free(dj->bitset);
+                }
+            }
+            else
+            {
+                // final state
+                if (dj->bitset)
+                {
+                    bitset_free(dj->bitset);
+                }
+            }
+        }
+        bytes += di->ranges.capacity * sizeof(dfa_range_t);
+        ++id;
+    }
+    vec_deinit(&work);
+    state_table_free(&table);
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        dfa->data[i]->index = i;
+    }
+    return dfa;
+}
+
+static void nfa_check_cost(const nfa_t *nfa, bool force)
+{
+    nfa_cost_t cost = nfa_estimate(nfa);
+    if (!force && cost.states > DFA_STATE_BUDGET)
+    {
+        fprintf(stderr, "Pattern may need about %.0f DFA states (%.0f bytes of tables); use -f to compile it anyway\n",
+                cost.states, cost.bytes);
+        exit(1);
+    }
+}
+
+static dfa_t *compile_dfa(nfa_t *nfa, bool force)
+{
+    // even a forced pattern stops at the hard limits
+    nfa_check_cost(nfa, force);
+    dfa_t *dfa = nfa_to_dfa(nfa, &dfa_default_limits);
+    if (!dfa)
+    {
+        fprintf(stderr, "DFA grew past %zu states or %zu bytes\n", dfa_default_limits.max_states,
+                dfa_default_limits.max_bytes);
+        exit(1);
+    }
+    return dfa;
+}
+
+// subset construction for machines too big to hold as dfa_node_t. a state
+// is kept only as its NFA set, delta-coded into a spill file, plus one
+// entry in a hash table; rows are written out as soon as they are known
+// and never revisited, since states are expanded in the order they were
+// found. the table file holds a table_header_t; the entry state of each
+// start condition inside a line, then of each at the start of a line (the
+// input's start or after a newline), where its ^ rules match without
+// reading the newline; then per state 0x80 next states (-1 for none) and
+// the rule it accepts. column 0x7F is BYTE_OTHER, read for NUL and every
+// byte from 0x7F up, so column 0 is always -1
+#define TABLE_MAGIC 0x46444c50
+#define TABLE_MAX_BYTES ((size_t)8 << 30)
+
+static const dfa_limits_t table_default_limits = {0, TABLE_MAX_BYTES};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t conditions;
+    uint32_t states;
+    uint32_t columns;
+} table_header_t;
+
+// an append-only byte array mapped from an unlinked temporary file, so
+// the kernel can write cold pages back to disk instead of keeping them in
+// memory
+typedef struct
+{
+    FILE *file;
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} spill_t;
+
+static void spill_init(spill_t *spill)
+{
+    spill->file = tmpfile();
+    if (!spill->file)
+    {
+        perror("tmpfile");
+        exit(1);
+    }
+    spill->data = NULL;
+    spill->length = 0;
+    spill->capacity = 0;
+}
+
+static void spill_append(spill_t *spill, const uint8_t *bytes, size_t length)
+{
+    if (spill->length + length > spill->capacity)
+    {
+        size_t capacity = spill->capacity ? spill->capacity : 0x100000;
+        while (spill->length + length > capacity)
+        {
+            capacity *= 2;
+        }
+        if (spill->data)
+        {
+            munmap(spill->data, spill->capacity);
+        }
+        spill->data = MAP_FAILED;
+        if (ftruncate(fileno(spill->file), capacity) == 0)
+        {
+            spill->data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(spill->file), 0);
+        }
+        if (spill->data == MAP_FAILED)
+        {
+            perror("spill");
+            exit(1);
+        }
+        spill->capacity = capacity;
+    }
+    memcpy(spill->data + spill->length, bytes, length);
+    spill->length += length;
+}
+
+static void spill_free(spill_t *spill)
+{
+    if (spill->data)
+    {
+        munmap(spill->data, spill->capacity);
+    }
+    fclose(spill->file);
+}
+
+typedef vec_t(uint8_t) vec_u8_t;
+typedef vec_t(size_t) vec_size_t;
+
+typedef struct
+{
+    // state number + 1, 0 for an empty slot
+    uint32_t state;
+    uint32_t hash;
+} subset_slot_t;
+
+typedef struct
+{
+    const nfa_t *nfa;
+    uint64_t (*chars)[2];
+    // closure marks, compared against stamp so they only need clearing
+    // when it wraps
+    uint32_t *mark;
+    uint32_t stamp;
+    spill_t sets;
+    // where each state's set starts in sets, and one past the last
+    vec_size_t offsets;
+    subset_slot_t *slots;
+    size_t nslots;
+    vec_u8_t code;
+    vec_int_t stack;
+} subset_builder_t;
+
+static int compare_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static void subset_closure(subset_builder_t *b, vec_int_t *set)
+{
+    // set holds the seed nodes and is replaced by their sorted closure
+    if (++b->stamp == 0)
+    {
+        memset(b->mark, 0, b->nfa->nfa.length * sizeof(uint32_t));
+        b->stamp = 1;
+    }
+    vec_clear(&b->stack);
+    for (int i = 0; i < set->length; ++i)
+    {
+        if (b->mark[set->data[i]] != b->stamp)
+        {
+            b->mark[set->data[i]] = b->stamp;
+            vec_push(&b->stack, set->data[i]);
+        }
+    }
+    while (b->stack.length > 0)
+    {
+        nfa_node_t *p = b->nfa->nfa.data[vec_pop(&b->stack)];
+        if (p->edge != EDGE_EPSILON)
+        {
+            continue;
+        }
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j] && b->mark[p->next[j]->index] != b->stamp)
+            {
+                b->mark[p->next[j]->index] = b->stamp;
+                vec_push(set, p->next[j]->index);
+                vec_push(&b->stack, p->next[j]->index);
+            }
+        }
+    }
+    vec_sort(set, compare_ints);
+}
+
+static uint32_t subset_encode(subset_builder_t *b, const vec_int_t *set)
+{
+    // gaps between the sorted node numbers as base-128 varints, hashed
+    // with FNV-1a
+    vec_clear(&b->code);
+    uint32_t hash = 2166136261u;
+    int last = 0;
+    for (int i = 0; i < set->length; ++i)
+    {
+        unsigned gap = set->data[i] - last;
+        last = set->data[i];
+        do
+        {
+            uint8_t byte = (gap & 0x7F) | (gap > 0x7F ? 0x80 : 0);
+            vec_push(&b->code, byte);
+            hash = (hash ^ byte) * 16777619u;
+            gap >>= 7;
+        } while (gap);
+    }
+    return hash;
+}
+
+static void subset_decode(const subset_builder_t *b, int state, vec_int_t *set)
+{
+    vec_clear(set);
+    const uint8_t *p = b->sets.data + b->offsets.data[state];
+    const uint8_t *end = b->sets.data + b->offsets.data[state + 1];
+    int last = 0;
+    while (p < end)
+    {
+        unsigned gap = 0;
+        int shift = 0;
+        do
+        {
+            gap |= (unsigned)(*p & 0x7F) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        last += gap;
+        vec_push(set, last);
+    }
+}
+
+static void subset_grow(subset_builder_t *b)
+{
+    size_t nslots = b->nslots ? 2 * b->nslots : 0x1000;
+    subset_slot_t *slots = calloc(nslots, sizeof(subset_slot_t));
+    for (size_t i = 0; i < b->nslots; ++i)
+    {
+        if (b->slots[i].state)
+        {
+            size_t j = b->slots[i].hash & (nslots - 1);
+            while (slots[j].state)
+            {
+                j = (j + 1) & (nslots - 1);
+            }
+            slots[j] = b->slots[i];
+        }
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->nslots = nslots;
+}
+
+static int subset_state(subset_builder_t *b, const vec_int_t *set)
+{
+    // the number of the state for set, a new one if it has none yet
+    uint32_t hash = subset_encode(b, set);
+    size_t length = b->code.length;
+    size_t j = hash & (b->nslots - 1);
+    for (; b->slots[j].state; j = (j + 1) & (b->nslots - 1))
+    {
+        int state = b->slots[j].state - 1;
+        size_t offset = b->offsets.data[state];
+        if (b->slots[j].hash == hash && b->offsets.data[state + 1] - offset == length &&
+            memcmp(b->sets.data + offset, b->code.data, length) == 0)
+        {
+            return state;
+        }
+    }
+    int state = b->offsets.length - 1;
+    spill_append(&b->sets, b->code.data, length);
+    vec_push(&b->offsets, b->sets.length);
+    b->slots[j].state = state + 1;
+    b->slots[j].hash = hash;
+    if (2 * (size_t)b->offsets.length > b->nslots)
+    {
+        subset_grow(b);
+    }
+    return state;
+}
+
+static int nfa_to_table(nfa_t *nfa, const dfa_limits_t *limits, FILE *out)
+{
+    // the number of states written, or -1 if the machine outgrew limits
+    // or out could not be written
+    subset_builder_t b;
+    int n = nfa->nfa.length;
+    b.nfa = nfa;
+    b.chars = calloc(n ? n : 1, sizeof(*b.chars));
+    b.mark = calloc(n ? n : 1, sizeof(uint32_t));
+    b.stamp = 0;
+    spill_init(&b.sets);
+    vec_init(&b.offsets);
+    vec_push(&b.offsets, 0);
+    b.slots = NULL;
+    b.nslots = 0;
+    subset_grow(&b);
+    vec_init(&b.code);
+    vec_init(&b.stack);
+    for (int i = 0; i < n; ++i)
+    {
+        if (nfa->nfa.data[i] && nfa->nfa.data[i]->edge != EDGE_EPSILON && nfa->nfa.data[i]->edge != EDGE_EMPTY)
+        {
+            nfa_node_chars(nfa->nfa.data[i], b.chars[i]);
+        }
+    }
+
+    vec_int_t set;
+    vec_int_t targets;
+    vec_init(&set);
+    vec_init(&targets);
+    // without ^ rules nfa_line_starts added no line entries, and a line
+    // starts in the same state as anywhere else
+    int lines = nfa->starts.length > nfa->conditions.length ? nfa->conditions.length : 0;
+    int conditions = nfa->starts.length - lines;
+    table_header_t header = {TABLE_MAGIC, conditions, 0, 0x80};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (int c = 0; c < 2 * conditions; ++c)
+    {
+        vec_clear(&set);
+        vec_push(&set, nfa->starts.data[c < conditions || lines ? c : c - conditions]);
+        subset_closure(&b, &set);
+        int32_t entry = subset_state(&b, &set);
+        ok = ok && fwrite(&entry, sizeof(entry), 1, out) == 1;
+    }
+
+    int32_t row[0x81];
+    int state = 0;
+    for (; ok && state < b.offsets.length - 1; ++state)
+    {
+        size_t bytes = b.nslots * sizeof(subset_slot_t) + b.offsets.capacity * sizeof(size_t);
+        if (limits && ((limits->max_states && (size_t)b.offsets.length - 1 > limits->max_states) ||
+                       (limits->max_bytes && bytes > limits->max_bytes)))
+        {
+            ok = false;
+            break;
+        }
+        subset_decode(&b, state, &set);
+        row[0x80] = 0;
+        for (int i = 0; i < set.length; ++i)
+        {
+            int accept = nfa->nfa.data[set.data[i]]->accept;
+            if (accept && (!row[0x80] || accept < row[0x80]))
+            {
+                row[0x80] = accept;
+            }
+        }
+        row[0] = -1;
+        for (int c = 1; c <= BYTE_OTHER; ++c)
+        {
+            vec_clear(&targets);
+            for (int i = 0; i < set.length; ++i)
+            {
+                if (b.chars[set.data[i]][c >> 6] & (uint64_t)1 << (c & 63))
+                {
+                    vec_push(&targets, nfa->nfa.data[set.data[i]]->next[0]->index);
+                }
+            }
+            if (targets.length == 0)
+            {
+                row[c] = -1;
+                continue;
+            }
+            subset_closure(&b, &targets);
+            row[c] = subset_state(&b, &targets);
+        }
+        ok = fwrite(row, sizeof(row), 1, out) == 1;
+    }
+    header.states = state;
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+
+    vec_deinit(&set);
+    vec_deinit(&targets);
+    vec_deinit(&b.stack);
+    vec_deinit(&b.code);
+    free(b.slots);
+    vec_deinit(&b.offsets);
+    spill_free(&b.sets);
+    free(b.mark);
+    free(b.chars);
+    return ok ? state : -1;
+}
+
+static void dfa_to_dot(const dfa_t *dfa)
+{
+    printf("digraph test {\n");
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        const dfa_node_t *di = dfa->data[i];
+        for (int j = 0; j < di->ranges.length; ++j)
+        {
+            // one edge per target, labelled with all of its ranges
+            const dfa_node_t *dj = di->ranges.data[j].next;
+            bool seen = false;
+            for (int k = 0; k < j && !seen; ++k)
+            {
+                seen = di->ranges.data[k].next == dj;
+            }
+            if (seen)
+            {
+                continue;
+            }
+            printf("%c -> %c [ label = \"'", di->id, dj->id);
+            for (char c = 0; c < 0x7F; ++c)
+            {
+                if (do_goto(di, c) == dj)
+                {
+                    if (c == '\'' || c == '"' || c == '\\')
+                    {
+                        printf("\\");
+                    }
+                    if (c < ' ')
+                    {
+                        printf("^%c", c + '@');
+                    }
+                    else
+                    {
+                        printf("%c", c);
+                    }
+                }
+            }
+            printf("'\" ]\n");
+        }
+        // if (di->next.length == 0) {
+        //   printf("%c is an accepting state\n", di->id);
+        // }
+    }
+    printf("}\n");
+}
+
+typedef vec_t(dfa_node_t *) partition_t;
+typedef vec_t(partition_t *) vec_partition_t;
+
+static dfa_node_t *range_target(const dfa_node_t *node, int *i, int c, int *end)
+{
+    // where c leads from node, or NULL, lowering end to where that answer
+    // stops holding; *i walks node's ranges as c grows. node may be NULL
+    while (node && *i < node->ranges.length && node->ranges.data[*i].hi < c)
+    {
+        ++*i;
+    }
+    if (!node || *i == node->ranges.length)
+    {
+        return NULL;
+    }
+    const dfa_range_t *r = &node->ranges.data[*i];
+    if (r->lo > c)
+    {
+        *end = r->lo < *end ? r->lo : *end;
+        return NULL;
+    }
+    *end = r->hi + 1 < *end ? r->hi + 1 : *end;
+    return r->next;
+}
+
+static bool dfa_nodes_equivalent(dfa_node_t *n1, dfa_node_t *n2)
+{
+    // walks both range lists together, one stretch of characters with the
+    // same targets at a time
+    int i1 = 0;
+    int i2 = 0;
+    for (int c = 0; c <= BYTE_OTHER;)
+    {
+        int end = BYTE_OTHER + 1;
+        dfa_node_t *g1 = range_target(n1, &i1, c, &end);
+        dfa_node_t *g2 = range_target(n2, &i2, c, &end);
+        if ((g1 ? g1->partition : -1) != (g2 ? g2->partition : -1))
+        {
+            return false;
+        }
+        c = end;
+    }
+    return true;
+}
+
+static bool trail_equals(bitset_t *t1, bitset_t *t2)
+{
+    size_t c1 = t1 ? bitset_count(t1) : 0;
+    size_t c2 = t2 ? bitset_count(t2) : 0;
+    return c1 == c2 && (c1 == 0 || bitset_equals(t1, t2));
+}
+
+static dfa_t *minimize_dfa(dfa_t *dfa)
+{
+    // one partition per accepted rule, plus the nonaccepting states
+    // until nothing changes:
+    //  for each partition:
+    //   for each state in the partition:
+    //    move all states that are not equivalent to the first
+    //    to a new partition
+    // the start state lands in partition 0, so it stays state 0
+    vec_partition_t partitions;
+    vec_init(&partitions);
+    for (int i = 0; i < dfa->length; i++)
+    {
+        dfa_node_t *di = dfa->data[i];
+        int j = 0;
+        while (j < partitions.length && (partitions.data[j]->data[0]->accept != di->accept ||
+                                         !trail_equals(partitions.data[j]->data[0]->trail, di->trail)))
+        {
+            ++j;
+        }
+        if (j == partitions.length)
+        {
+            partition_t *p = GC_malloc(sizeof(partition_t));
+            vec_init(p);
+            vec_push(&partitions, p);
+        }
+        di->partition = j;
+        vec_push(partitions.data[j], di);
+    }
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = 0; i < partitions.length; ++i)
+        {
+            dfa_node_t *first = partitions.data[i]->data[0];
+            partition_t *new_partition = NULL;
+            for (int j = 0; j < partitions.data[i]->length; ++j)
+            {
+                dfa_node_t *dij = partitions.data[i]->data[j];
+                if (dfa_nodes_equivalent(first, dij))
+                {
+                    continue;
+                }
+                if (new_partition == NULL)
+                {
+                    new_partition = GC_malloc(sizeof(partition_t));
+                    vec_init(new_partition);
+                }
+                vec_push(new_partition, dij);
+                vec_splice(partitions.data[i], j, 1);
+                --j;
+                dij->partition = partitions.length;
+            }
+            if (new_partition != NULL)
+            {
+                vec_push(&partitions, new_partition);
+                changed = true;
+            }
+        }
+    }
+
+    dfa_t *new_dfa = GC_malloc(sizeof(dfa_t));
+    vec_init(new_dfa);
+    for (int i = 0; i < partitions.length; ++i)
+    {
+        dfa_node_t *node = GC_malloc(sizeof(dfa_node_t));
+        dfa_node_t *old = partitions.data[i]->data[0];
+        node->index = i;
+        node->bitset = bitset_create();
+        node->id = i + 'A';
+        node->partition = i;
+        node->accept = old->accept;
+        node->trail = old->trail ? bitset_copy(old->trail) : NULL;
+        for (int j = 0; j < partitions.data[i]->length; ++j)
+        {
+            dfa_node_t *member = partitions.data[i]->data[j];
+            if (member->entry)
+            {
+                if (!node->entry)
+                {
+                    node->entry = bitset_create();
+                }
+                bitset_inplace_union(node->entry, member->entry);
+            }
+        }
+        vec_init(&node->ranges);
+        vec_push(new_dfa, node);
+    }
+    for (int i = 0; i < partitions.length; ++i)
+    {
+        // ranges that led to different members of one partition merge here
+        dfa_node_t *old = partitions.data[i]->data[0];
+        for (int j = 0; j < old->ranges.length; ++j)
+        {
+            dfa_range_t *r = &old->ranges.data[j];
+            dfa_add_range(new_dfa->data[i], r->lo, r->hi, new_dfa->data[r->next->partition]);
+        }
+        vec_deinit(partitions.data[i]);
+    }
+    vec_deinit(&partitions);
+    return new_dfa;
+}
+
+#define PRODUCT_INTERSECTION 0
+#define PRODUCT_UNION 1
+#define PRODUCT_DIFFERENCE 2
+
+static dfa_node_t *new_dfa_node(dfa_t *dfa)
+{
+    dfa_node_t *node = GC_malloc(sizeof(dfa_node_t));
+    memset(node, 0, sizeof(dfa_node_t));
+    node->bitset = bitset_create();
+    node->index = dfa->length;
+    node->id = 'A' + dfa->length;
+    node->partition = dfa->length;
+    vec_init(&node->ranges);
+    vec_push(dfa, node);
+    return node;
+}
+
+static bool product_accepts(int op, bool a, bool b)
+{
+    switch (op)
+    {
+    case PRODUCT_INTERSECTION:
+        return a && b;
+    case PRODUCT_UNION:
+        return a || b;
+    default:
+        return a && !b;
+    }
+}
+
+static bool product_dead(int op, int i, int j)
+{
+    // -1 is the dead state of a machine with no transition. a pair that
+    // can never accept again is left out instead of being built
+    switch (op)
+    {
+    case PRODUCT_INTERSECTION:
+        return i < 0 || j < 0;
+    case PRODUCT_UNION:
+        return i < 0 && j < 0;
+    default:
+        return i < 0;
+    }
+}
+
+static dfa_t *dfa_product(dfa_t *a, dfa_t *b, int op)
+{
+    // every state of the result is a pair of states, one from each machine,
+    // so a single pass over the input runs both. only the pairs that are
+    // reached get a state, found by their hash
+    vec_int_t pairs;
+    vec_init(&pairs);
+    state_table_t table;
+    state_table_init(&table);
+    dfa_t *dfa = GC_malloc(sizeof(dfa_t));
+    vec_init(dfa);
+    new_dfa_node(dfa);
+    vec_push(&pairs, 0);
+    vec_push(&pairs, 0);
+    uint64_t hash = fnv1a(FNV_OFFSET, pairs.data, 2 * sizeof(int));
+    size_t slot = hash;
+    state_table_next(&table, hash, &slot);
+    state_table_add(&table, slot, hash, 0);
+    for (int k = 0; k < dfa->length; ++k)
+    {
+        int i = pairs.data[2 * k];
+        int j = pairs.data[2 * k + 1];
+        dfa_node_t *node = dfa->data[k];
+        node->accept = product_accepts(op, i >= 0 && a->data[i]->accept, j >= 0 && b->data[j]->accept);
+        int ia = 0;
+        int ib = 0;
+        for (int c = 1, end; c <= BYTE_OTHER; c = end)
+        {
+            // one stretch of characters with the same pair of targets
+            end = BYTE_OTHER + 1;
+            dfa_node_t *ga = range_target(i >= 0 ? a->data[i] : NULL, &ia, c, &end);
+            dfa_node_t *gb = range_target(j >= 0 ? b->data[j] : NULL, &ib, c, &end);
+            int ni = ga ? ga->index : -1;
+            int nj = gb ? gb->index : -1;
+            if (product_dead(op, ni, nj))
+            {
+                continue;
+            }
+            int pair[2] = {ni, nj};
+            hash = fnv1a(FNV_OFFSET, pair, sizeof(pair));
+            int state;
+            for (slot = hash; (state = state_table_next(&table, hash, &slot)) >= 0;)
+            {
+                if (pairs.data[2 * state] == ni && pairs.data[2 * state + 1] == nj)
+                {
+                    break;
+                }
+            }
+            if (state < 0)
+            {
+                state = dfa->length;
+                state_table_add(&table, slot, hash, state);
+                new_dfa_node(dfa);
+                vec_push(&pairs, ni);
+                vec_push(&pairs, nj);
+            }
+            dfa_add_range(node, c, end - 1, dfa->data[state]);
+        }
+    }
+    state_table_free(&table);
+    vec_deinit(&pairs);
+    return dfa;
+}
+
+static dfa_t *dfa_complement(dfa_t *a)
+{
+    // everything minus a
+    dfa_t universe;
+    vec_init(&universe);
+    dfa_node_t *any = new_dfa_node(&universe);
+    any->accept = 1;
+    dfa_add_range(any, 1, BYTE_OTHER, any);
+    dfa_t *dfa = dfa_product(&universe, a, PRODUCT_DIFFERENCE);
+    dfa_free(&universe);
+    return dfa;
+}
+
+// a minimal acyclic automaton built straight from a sorted word list
+// (Daciuk et al.), for alternations too large for thompson. the nodes of
+// the previous word stay open; once the next word leaves them they are
+// replaced by an equivalent registered node or registered themselves
+typedef struct
+{
+    bool final;
+    // (character, target) pairs
+    vec_int_t edges;
+} dawg_node_t;
+
+typedef struct
+{
+    vec_t(dawg_node_t) nodes;
+    vec_int_t free;
+    // nodes along the previous word, the root first
+    vec_int_t path;
+    const char *previous;
+    // open addressing over registered nodes, -1 for empty slots
+    int *table;
+    size_t table_size;
+    size_t registered;
+} dawg_t;
+
+static uint64_t dawg_hash(const dawg_node_t *node)
+{
+    uint64_t h = 14695981039346656037ULL ^ node->final;
+    for (int i = 0; i < node->edges.length; ++i)
+    {
+        h = (h ^ (uint32_t)node->edges.data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static bool dawg_nodes_equal(const dawg_node_t *n1, const dawg_node_t *n2)
+{
+    return n1->final == n2->final && n1->edges.length == n2->edges.length &&
+           memcmp(n1->edges.data, n2->edges.data, n1->edges.length * sizeof(int)) == 0;
+}
+
+static void dawg_insert(dawg_t *dawg, int node)
+{
+    size_t mask = dawg->table_size - 1;
+    size_t slot = dawg_hash(&dawg->nodes.data[node]) & mask;
+    while (dawg->table[slot] >= 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    dawg->table[slot] = node;
+}
+
+static int dawg_register(dawg_t *dawg, int node)
+{
+    // the registered node equivalent to node, which is registered itself
+    // if there is none
+    if (2 * (dawg->registered + 1) > dawg->table_size)
+    {
+        int *old = dawg->table;
+        size_t old_size = dawg->table_size;
+        dawg->table_size = old_size ? 2 * old_size : 0x400;
+        dawg->table = malloc(dawg->table_size * sizeof(int));
+        memset(dawg->table, -1, dawg->table_size * sizeof(int));
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (old[i] >= 0)
+            {
+                dawg_insert(dawg, old[i]);
+            }
+        }
+        free(old);
+    }
+    size_t mask = dawg->table_size - 1;
+    for (size_t slot = dawg_hash(&dawg->nodes.data[node]) & mask; dawg->table[slot] >= 0; slot = (slot + 1) & mask)
+    {
+        if (dawg_nodes_equal(&dawg->nodes.data[dawg->table[slot]], &dawg->nodes.data[node]))
+        {
+            return dawg->table[slot];
+        }
+    }
+    dawg_insert(dawg, node);
+    ++dawg->registered;
+    return node;
+}
+
+static int dawg_alloc(dawg_t *dawg)
+{
+    if (dawg->free.length > 0)
+    {
+        int node = vec_pop(&dawg->free);
+        dawg->nodes.data[node].final = false;
+        return node;
+    }
+    dawg_node_t node;
+    node.final = false;
+    vec_init(&node.edges);
+    vec_push(&dawg->nodes, node);
+    return dawg->nodes.length - 1;
+}
+
+static void dawg_minimize(dawg_t *dawg, int depth)
+{
+    // closes the previous word's nodes below depth, deepest first, so each
+    // one's children are already registered when it is looked up
+    while (dawg->path.length > depth + 1)
+    {
+        int node = vec_pop(&dawg->path);
+        int canonical = dawg_register(dawg, node);
+        if (canonical != node)
+        {
+            vec_last(&dawg->nodes.data[vec_last(&dawg->path)].edges) = canonical;
+            vec_clear(&dawg->nodes.data[node].edges);
+            vec_push(&dawg->free, node);
+        }
+    }
+}
+
+static void dawg_add(dawg_t *dawg, const char *word, bool minimize)
+{
+    // words must come in sorted order, without duplicates. without
+    // minimize nothing is merged, and the nodes are a trie
+    int depth = 0;
+    while (dawg->previous && word[depth] && word[depth] == dawg->previous[depth])
+    {
+        ++depth;
+    }
+    if (minimize)
+    {
+        dawg_minimize(dawg, depth);
+    }
+    else
+    {
+        dawg->path.length = depth + 1;
+    }
+    for (const char *c = word + depth; *c; ++c)
+    {
+        int node = dawg_alloc(dawg);
+        vec_int_t *edges = &dawg->nodes.data[vec_last(&dawg->path)].edges;
+        vec_push(edges, (unsigned char)*c);
+        vec_push(edges, node);
+        vec_push(&dawg->path, node);
+    }
+    dawg->nodes.data[vec_last(&dawg->path)].final = true;
+    dawg->previous = word;
+}
+
+static int compare_words(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void sort_words(vec_str_t *words, int flags)
+{
+    // in place; folded words are lowercased first
+    for (int i = 0; i < words->length; ++i)
+    {
+        for (char *c = words->data[i]; *c; ++c)
+        {
+            if ((unsigned char)*c >= 0x7F)
+            {
+                fprintf(stderr, "words must be 7-bit ASCII: %s\n", words->data[i]);
+                exit(1);
+            }
+            if (flags & REGEX_FOLD_CASE)
+            {
+                *c = tolower((unsigned char)*c);
+            }
+        }
+    }
+    vec_sort(words, compare_words);
+}
+
+static dfa_t *dfa_from_words(vec_str_t *words, int flags)
+{
+    // the words are sorted in place
+    sort_words(words, flags);
+    dawg_t dawg;
+    memset(&dawg, 0, sizeof(dawg_t));
+    vec_init(&dawg.nodes);
+    vec_init(&dawg.free);
+    vec_init(&dawg.path);
+    vec_push(&dawg.path, dawg_alloc(&dawg));
+    for (int i = 0; i < words->length; ++i)
+    {
+        if (!dawg.previous || strcmp(words->data[i], dawg.previous) != 0)
+        {
+            dawg_add(&dawg, words->data[i], true);
+        }
+    }
+    dawg_minimize(&dawg, 0);
+
+    // breadth first from the root, so the root is state 0
+    dfa_t *dfa = GC_malloc(sizeof(dfa_t));
+    vec_init(dfa);
+    vec_int_t states;
+    vec_init(&states);
+    for (int i = 0; i < dawg.nodes.length; ++i)
+    {
+        vec_push(&states, -1);
+    }
+    vec_int_t order;
+    vec_init(&order);
+    vec_push(&order, 0);
+    states.data[0] = 0;
+    new_dfa_node(dfa);
+    for (int k = 0; k < order.length; ++k)
+    {
+        dawg_node_t *from = &dawg.nodes.data[order.data[k]];
+        dfa_node_t *node = dfa->data[k];
+        node->accept = from->final;
+        for (int j = 0; j < from->edges.length; j += 2)
+        {
+            int c = from->edges.data[j];
+            int to = from->edges.data[j + 1];
+            if (states.data[to] < 0)
+            {
+                states.data[to] = dfa->length;
+                new_dfa_node(dfa);
+                vec_push(&order, to);
+            }
+            dfa_add_edge(node, dfa->data[states.data[to]], c);
+            if ((flags & REGEX_FOLD_CASE) && isalpha(c))
+            {
+                dfa_add_edge(node, dfa->data[states.data[to]], toupper(c));
+            }
+        }
+    }
+    vec_deinit(&order);
+    vec_deinit(&states);
+    for (int i = 0; i < dawg.nodes.length; ++i)
+    {
+        vec_deinit(&dawg.nodes.data[i].edges);
+    }
+    vec_deinit(&dawg.nodes);
+    vec_deinit(&dawg.free);
+    vec_deinit(&dawg.path);
+    free(dawg.table);
+    return dfa;
+}
+
+static dfa_t *dfa_search_words(vec_str_t *words, int flags)
+{
+    // (any)*W(any)* for a word list W (Aho-Corasick): the trie of the
+    // words, where a character with no edge follows the failure link, the
+    // longest proper suffix of what was read that is still in the trie.
+    // every node that ends a word, or has such a suffix, is one accepting
+    // state that loops on everything. the words are sorted in place
+    sort_words(words, flags);
+    dawg_t trie;
+    memset(&trie, 0, sizeof(dawg_t));
+    vec_init(&trie.nodes);
+    vec_init(&trie.free);
+    vec_init(&trie.path);
+    vec_push(&trie.path, dawg_alloc(&trie));
+    for (int i = 0; i < words->length; ++i)
+    {
+        if (!trie.previous || strcmp(words->data[i], trie.previous) != 0)
+        {
+            dawg_add(&trie, words->data[i], false);
+        }
+    }
+
+    // breadth first, so a node's failure link is done before the node;
+    // states maps trie nodes to DFA states and nodes maps back
+    dfa_t *dfa = GC_malloc(sizeof(dfa_t));
+    vec_init(dfa);
+    new_dfa_node(dfa);
+    dfa_node_t *found = new_dfa_node(dfa);
+    found->accept = 1;
+    dfa_add_range(found, 1, BYTE_OTHER, found);
+    int *states = malloc(trie.nodes.length * sizeof(int));
+    int *fail = malloc(trie.nodes.length * sizeof(int));
+    vec_int_t nodes;
+    vec_init(&nodes);
+    vec_push(&nodes, 0);
+    vec_push(&nodes, -1);
+    states[0] = 0;
+    fail[0] = 0;
+    vec_int_t order;
+    vec_init(&order);
+    vec_push(&order, 0);
+    for (int k = 0; k < order.length; ++k)
+    {
+        int t = order.data[k];
+        dfa_node_t *node = dfa->data[states[t]];
+        dfa_node_t *back = dfa->data[states[fail[t]]];
+        dfa_node_t *next[0x80] = {NULL};
+        vec_int_t *edges = &trie.nodes.data[t].edges;
+        for (int j = 0; j < edges->length; j += 2)
+        {
+            int c = edges->data[j];
+            int child = edges->data[j + 1];
+            dfa_node_t *suffix = t == 0 ? dfa->data[0] : do_goto(back, c);
+            if (trie.nodes.data[child].final || suffix == found)
+            {
+                states[child] = found->index;
+            }
+            else
+            {
+                fail[child] = nodes.data[suffix->index];
+                states[child] = dfa->length;
+                new_dfa_node(dfa);
+                vec_push(&nodes, child);
+                vec_push(&order, child);
+            }
+            next[c] = dfa->data[states[child]];
+        }
+        for (int c = 1; c <= BYTE_OTHER; ++c)
+        {
+            int folded = (flags & REGEX_FOLD_CASE) ? tolower(c) : c;
+            dfa_node_t *to = next[folded] ? next[folded] : t == 0 ? dfa->data[0] : do_goto(back, c);
+            dfa_add_edge(node, to, c);
+        }
+    }
+    vec_deinit(&order);
+    vec_deinit(&nodes);
+    free(states);
+    free(fail);
+    for (int i = 0; i < trie.nodes.length; ++i)
+    {
+        vec_deinit(&trie.nodes.data[i].edges);
+    }
+    vec_deinit(&trie.nodes);
+    vec_deinit(&trie.free);
+    vec_deinit(&trie.path);
+    return dfa;
+}
+
+static bool literal_alternation(const char *input, vec_str_t *words)
+{
+    // true if input is nothing but plain literals separated by '|', which
+    // are then pushed onto words
+    size_t length = strlen(input);
+    char *word = malloc(length + 1);
+    size_t n = 0;
+    for (const char *p = input;; ++p)
+    {
+        if (*p == '|' || *p == '\0')
+        {
+            if (n == 0)
+            {
+                break;
+            }
+            vec_push(words, copy_string(word, n));
+            n = 0;
+            if (*p == '\0')
+            {
+                free(word);
+                return true;
+            }
+            continue;
+        }
+        if (strchr("()[]*+?.^$/\"{}<>% \t\n", *p))
+        {
+            break;
+        }
+        word[n++] = esc(&p);
+        if (*p == '\0')
+        {
+            break;
+        }
+    }
+    free(word);
+    for (int i = 0; i < words->length; ++i)
+    {
+        free(words->data[i]);
+    }
+    vec_clear(words);
+    return false;
+}
+
+// small DFAs run with one byte shuffle per input byte (Sheng). row c holds
+// the next state of every state on c, so shuffling it by a vector filled
+// with the current state gives the next state in every lane, and the row
+// load depends only on the input. pshufb covers 16 states, and vpermb
+// covers 64 where the CPU has AVX-512 VBMI
+#define SHENG_STATES 16
+#define SHENG_WIDE_STATES 64
+
+typedef struct
+{
+    // 16 or 64 lanes per row
+    int width;
+    // 256 rows of width bytes; the last state is the dead one
+    uint8_t *rows;
+    bool accept[SHENG_WIDE_STATES];
+} sheng_t;
+
+static sheng_t *make_sheng(const dfa_t *dfa)
+{
+    // NULL if the DFA and its dead state do not fit, or the CPU cannot run
+    // the shuffles
+    int width = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (dfa->length + 1 <= SHENG_STATES && __builtin_cpu_supports("ssse3"))
+    {
+        width = SHENG_STATES;
+    }
+    else if (dfa->length + 1 <= SHENG_WIDE_STATES && __builtin_cpu_supports("avx512vbmi"))
+    {
+        width = SHENG_WIDE_STATES;
+    }
+#endif
+    if (!width)
+    {
+        return NULL;
+    }
+    sheng_t *sheng = GC_malloc(sizeof(sheng_t));
+    memset(sheng, 0, sizeof(sheng_t));
+    sheng->width = width;
+    sheng->rows = aligned_alloc(64, 0x100 * width);
+    int dead = dfa->length;
+    for (int c = 0; c < 0x100; ++c)
+    {
+        uint8_t *row = sheng->rows + c * width;
+        for (int i = 0; i < width; ++i)
+        {
+            dfa_node_t *next = i < dfa->length ? do_goto(dfa->data[i], c && c < BYTE_OTHER ? c : BYTE_OTHER) : NULL;
+            row[i] = next ? next->index : dead;
+        }
+    }
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        sheng->accept[i] = dfa->data[i]->accept;
+    }
+    return sheng;
+}
+
+static void sheng_free(sheng_t *sheng)
+{
+    free(sheng->rows);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3"))) static int sheng_run16(const sheng_t *sheng, int state, const unsigned char *text,
+                                                         size_t length)
+{
+    const __m128i *rows = (const __m128i *)sheng->rows;
+    __m128i s = _mm_set1_epi8((char)state);
+    for (size_t i = 0; i < length; ++i)
+    {
+        s = _mm_shuffle_epi8(_mm_load_si128(&rows[text[i]]), s);
+    }
+    return _mm_cvtsi128_si32(s) & 0xFF;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) static int sheng_run64(const sheng_t *sheng, int state,
+                                                                               const unsigned char *text,
+                                                                               size_t length)
+{
+    const __m512i *rows = (const __m512i *)sheng->rows;
+    __m512i s = _mm512_set1_epi8((char)state);
+    for (size_t i = 0; i < length; ++i)
+    {
+        s = _mm512_permutexvar_epi8(s, _mm512_load_si512(&rows[text[i]]));
+    }
+    return _mm_cvtsi128_si32(_mm512_castsi512_si128(s)) & 0xFF;
+}
+#endif
+
+static int sheng_run(const sheng_t *sheng, int state, const char *text, size_t length)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (sheng->width == SHENG_STATES)
+    {
+        return sheng_run16(sheng, state, (const unsigned char *)text, length);
+    }
+    return sheng_run64(sheng, state, (const unsigned char *)text, length);
+#else
+    return state;
+#endif
+}
+
+// a tagged DFA (Laurikari) for submatch extraction. a state is the list of
+// NFA nodes still alive, in priority order, and each of them owns one
+// register per tag. a transition says, for every node of the target, which
+// node of the source it continues and which tags it passed on the way, so
+// the registers are updated without simulating the NFA
+#define TDFA_MAX_TAGS 64
+
+typedef vec_t(uint64_t) vec_u64_t;
+
+typedef struct
+{
+    int target;
+    int *origin;
+    uint64_t *set;
+    // every node continues itself and no tag is set, so the registers
+    // stay as they are
+    bool identity;
+} tdfa_edge_t;
+
+typedef struct
+{
+    vec_int_t nodes;
+    tdfa_edge_t next[0x80];
+    // the first node that accepts, -1 if none
+    int final;
+} tdfa_state_t;
+
+typedef struct
+{
+    int tags;
+    // the most nodes any state has
+    int width;
+    vec_t(tdfa_state_t *) states;
+    // tags set before the first character, for each node of state 0
+    uint64_t *init;
+} tdfa_t;
+
+static bool tdfa_closure(nfa_node_t *from, int origin, bitset_t *visited, vec_int_t *nodes, vec_int_t *origins,
+                         vec_u64_t *sets, uint64_t *seen)
+{
+    // depth first with next[0] before next[1], and the first path to reach
+    // a node wins; that is leftmost greedy priority. with seen, the tags
+    // each node was reached with are kept, and false is returned if a
+    // second path reaches a node with different tags
+    bool unique = true;
+    vec_nfa_node_t stack;
+    vec_u64_t stack_sets;
+    vec_init(&stack);
+    vec_init(&stack_sets);
+    vec_push(&stack, from);
+    vec_push(&stack_sets, 0);
+    while (stack.length > 0)
+    {
+        nfa_node_t *p = vec_pop(&stack);
+        uint64_t set = vec_pop(&stack_sets);
+        if (bitset_get(visited, p->index))
+        {
+            unique = unique && (!seen || seen[p->index] == set);
+            continue;
+        }
+        bitset_set(visited, p->index);
+        if (seen)
+        {
+            seen[p->index] = set;
+        }
+        if (p->tag)
+        {
+            set |= (uint64_t)1 << (p->tag - 1);
+        }
+        if (p->accept || (p->edge != EDGE_EPSILON && p->edge != EDGE_EMPTY))
+        {
+            vec_push(nodes, p->index);
+            vec_push(origins, origin);
+            vec_push(sets, set);
+            continue;
+        }
+        for (int j = 1; j >= 0; --j)
+        {
+            if (p->next[j])
+            {
+                vec_push(&stack, p->next[j]);
+                vec_push(&stack_sets, set);
+            }
+        }
+    }
+    vec_deinit(&stack);
+    vec_deinit(&stack_sets);
+    return unique;
+}
+
+static tdfa_state_t *tdfa_state(nfa_t *nfa, tdfa_t *tdfa, state_table_t *table, vec_int_t *nodes, int *index)
+{
+    uint64_t hash = fnv1a(FNV_OFFSET, nodes->data, nodes->length * sizeof(int));
+    size_t slot = hash;
+    int i;
+    while ((i = state_table_next(table, hash, &slot)) >= 0)
+    {
+        vec_int_t *other = &tdfa->states.data[i]->nodes;
+        if (other->length == nodes->length && memcmp(other->data, nodes->data, nodes->length * sizeof(int)) == 0)
+        {
+            *index = i;
+            return tdfa->states.data[i];
+        }
+    }
+    state_table_add(table, slot, hash, tdfa->states.length);
+    tdfa_state_t *state = GC_malloc(sizeof(tdfa_state_t));
+    memset(state, 0, sizeof(tdfa_state_t));
+    vec_init(&state->nodes);
+    vec_extend(&state->nodes, nodes);
+    state->final = -1;
+    for (int i = 0; i < nodes->length && state->final < 0; ++i)
+    {
+        if (nfa->nfa.data[nodes->data[i]]->accept)
+        {
+            state->final = i;
+        }
+    }
+    if (nodes->length > tdfa->width)
+    {
+        tdfa->width = nodes->length;
+    }
+    *index = tdfa->states.length;
+    vec_push(&tdfa->states, state);
+    return state;
+}
+
+static void tdfa_free(tdfa_t *tdfa);
+
+static tdfa_t *nfa_to_tdfa(nfa_t *nfa, const dfa_limits_t *limits)
+{
+    // NULL as soon as the machine outgrows limits
+    if (2 * nfa->groups > TDFA_MAX_TAGS)
+    {
+        fprintf(stderr, "at most %d capturing groups are supported\n", TDFA_MAX_TAGS / 2);
+        exit(1);
+    }
+    tdfa_t *tdfa = GC_malloc(sizeof(tdfa_t));
+    memset(tdfa, 0, sizeof(tdfa_t));
+    tdfa->tags = 2 * nfa->groups;
+    vec_init(&tdfa->states);
+
+    bitset_t *visited = bitset_create();
+    vec_int_t nodes;
+    vec_int_t origins;
+    vec_u64_t sets;
+    vec_init(&nodes);
+    vec_init(&origins);
+    vec_init(&sets);
+    state_table_t table;
+    state_table_init(&table);
+    int index;
+    tdfa_closure(nfa->nfa.data[nfa->starts.data[0]], 0, visited, &nodes, &origins, &sets, NULL);
+    tdfa_state(nfa, tdfa, &table, &nodes, &index);
+    tdfa->init = malloc((sets.length + 1) * sizeof(uint64_t));
+    memcpy(tdfa->init, sets.data, sets.length * sizeof(uint64_t));
+
+    size_t bytes = 0;
+    bool fits = true;
+    for (int k = 0; fits && k < tdfa->states.length; ++k)
+    {
+        tdfa_state_t *from = tdfa->states.data[k];
+        for (int c = 0; c < 0x80; ++c)
+        {
+            tdfa_edge_t *edge = &from->next[c];
+            edge->target = -1;
+            if (c == 0 || c == 0x7F)
+            {
+                continue;
+            }
+            bitset_clear(visited);
+            vec_clear(&nodes);
+            vec_clear(&origins);
+            vec_clear(&sets);
+            for (int i = 0; i < from->nodes.length; ++i)
+            {
+                nfa_node_t *p = nfa->nfa.data[from->nodes.data[i]];
+                if (p->edge == c || (p->edge == EDGE_CHARACTER_CLASS && p->complement != bitset_get(p->bitset, c)))
+                {
+                    tdfa_closure(p->next[0], i, visited, &nodes, &origins, &sets, NULL);
+                }
+            }
+            if (nodes.length == 0)
+            {
+                continue;
+            }
+            tdfa_state(nfa, tdfa, &table, &nodes, &edge->target);
+            bytes += nodes.length * (sizeof(int) + sizeof(uint64_t));
+            edge->origin = malloc(nodes.length * sizeof(int));
+            edge->set = malloc(nodes.length * sizeof(uint64_t));
+            memcpy(edge->origin, origins.data, nodes.length * sizeof(int));
+            memcpy(edge->set, sets.data, nodes.length * sizeof(uint64_t));
+            edge->identity = true;
+            for (int j = 0; j < nodes.length; ++j)
+            {
+                edge->identity = edge->identity && origins.data[j] == j && sets.data[j] == 0;
+            }
+        }
+        bytes += sizeof(tdfa_state_t) + from->nodes.length * sizeof(int);
+        fits = (!limits->max_states || (size_t)tdfa->states.length <= limits->max_states) &&
+               (!limits->max_bytes || bytes <= limits->max_bytes);
+    }
+    vec_deinit(&nodes);
+    vec_deinit(&origins);
+    vec_deinit(&sets);
+    bitset_free(visited);
+    state_table_free(&table);
+    if (!fits)
+    {
+        tdfa_free(tdfa);
+        return NULL;
+    }
+    return tdfa;
+}
+
+static const int *tdfa_match(const tdfa_t *tdfa, const char *text, size_t length, int *buffer)
+{
+    // matches the whole of text. buffer holds two register banks of
+    // width * tags ints; the result points into it, two registers per
+    // group giving its start and end, or -1 if it did not take part
+    int tags = tdfa->tags;
+    int *regs = buffer;
+    int *spare = buffer + tdfa->width * tags;
+    tdfa_state_t *state = tdfa->states.data[0];
+    for (int j = 0; j < state->nodes.length; ++j)
+    {
+        for (int t = 0; t < tags; ++t)
+        {
+            regs[j * tags + t] = (tdfa->init[j] >> t & 1) ? 0 : -1;
+        }
+    }
+    for (size_t k = 0; k < length; ++k)
+    {
+        unsigned char c = text[k];
+        const tdfa_edge_t *edge = c < 0x80 ? &state->next[c] : NULL;
+        if (!edge || edge->target < 0)
+        {
+            return NULL;
+        }
+        state = tdfa->states.data[edge->target];
+        if (edge->identity)
+        {
+            continue;
+        }
+        for (int j = 0; j < state->nodes.length; ++j)
+        {
+            const int *from = regs + edge->origin[j] * tags;
+            for (int t = 0; t < tags; ++t)
+            {
+                spare[j * tags + t] = (edge->set[j] >> t & 1) ? (int)k + 1 : from[t];
+            }
+        }
+        int *swap = regs;
+        regs = spare;
+        spare = swap;
+    }
+    return state->final < 0 ? NULL : regs + state->final * tags;
+}
+
+static void tdfa_free(tdfa_t *tdfa)
+{
+    for (int i = 0; i < tdfa->states.length; ++i)
+    {
+        tdfa_state_t *state = tdfa->states.data[i];
+        for (int c = 0; c < 0x80; ++c)
+        {
+            free(state->next[c].origin);
+            free(state->next[c].set);
+        }
+        vec_deinit(&state->nodes);
+    }
+    vec_deinit(&tdfa->states);
+    free(tdfa->init);
+}
+
+// a pattern is one-pass when, at every step, at most one NFA node can
+// consume the next character. one thread is then alive at a time, so a
+// plain DFA whose transitions save tags into one register bank is enough
+typedef struct
+{
+    int target;
+    // tags passed on the way to the node that consumes the character
+    uint64_t set;
+} onepass_edge_t;
+
+typedef struct
+{
+    vec_int_t nodes;
+    vec_u64_t sets;
+    onepass_edge_t next[0x80];
+    // tags passed on the way to the accepting node, if there is one
+    bool final;
+    uint64_t final_set;
+} onepass_state_t;
+
+typedef struct
+{
+    int tags;
+    vec_t(onepass_state_t *) states;
+} onepass_t;
+
+static int onepass_state(nfa_t *nfa, onepass_t *onepass, state_table_t *table, vec_int_t *nodes, vec_u64_t *sets)
+{
+    uint64_t hash = fnv1a(FNV_OFFSET, nodes->data, nodes->length * sizeof(int));
+    hash = fnv1a(hash, sets->data, sets->length * sizeof(uint64_t));
+    size_t slot = hash;
+    int i;
+    while ((i = state_table_next(table, hash, &slot)) >= 0)
+    {
+        onepass_state_t *other = onepass->states.data[i];
+        if (other->nodes.length == nodes->length &&
+            memcmp(other->nodes.data, nodes->data, nodes->length * sizeof(int)) == 0 &&
+            memcmp(other->sets.data, sets->data, sets->length * sizeof(uint64_t)) == 0)
+        {
+            return i;
+        }
+    }
+    state_table_add(table, slot, hash, onepass->states.length);
+    onepass_state_t *state = GC_malloc(sizeof(onepass_state_t));
+    memset(state, 0, sizeof(onepass_state_t));
+    vec_init(&state->nodes);
+    vec_init(&state->sets);
+    vec_extend(&state->nodes, nodes);
+    vec_extend(&state->sets, sets);
+    for (int i = 0; i < nodes->length && !state->final; ++i)
+    {
+        if (nfa->nfa.data[nodes->data[i]]->accept)
+        {
+            state->final = true;
+            state->final_set = sets->data[i];
+        }
+    }
+    vec_push(&onepass->states, state);
+    return onepass->states.length - 1;
+}
+
+static void onepass_free(onepass_t *onepass)
+{
+    for (int i = 0; i < onepass->states.length; ++i)
+    {
+        vec_deinit(&onepass->states.data[i]->nodes);
+        vec_deinit(&onepass->states.data[i]->sets);
+    }
+    vec_deinit(&onepass->states);
+}
+
+static onepass_t *nfa_to_onepass(nfa_t *nfa, const dfa_limits_t *limits)
+{
+    // NULL if the pattern is not one-pass, or its machine outgrows limits
+    if (2 * nfa->groups > TDFA_MAX_TAGS)
+    {
+        return NULL;
+    }
+    onepass_t *onepass = GC_malloc(sizeof(onepass_t));
+    onepass->tags = 2 * nfa->groups;
+    vec_init(&onepass->states);
+
+    bitset_t *visited = bitset_create();
+    uint64_t *seen = malloc(nfa->nfa.length * sizeof(uint64_t));
+    vec_int_t nodes;
+    vec_int_t origins;
+    vec_u64_t sets;
+    vec_init(&nodes);
+    vec_init(&origins);
+    vec_init(&sets);
+    state_table_t table;
+    state_table_init(&table);
+    bool unique = tdfa_closure(nfa->nfa.data[nfa->starts.data[0]], 0, visited, &nodes, &origins, &sets, seen);
+    onepass_state(nfa, onepass, &table, &nodes, &sets);
+
+    size_t bytes = 0;
+    bool fits = true;
+    for (int k = 0; unique && fits && k < onepass->states.length; ++k)
+    {
+        onepass_state_t *from = onepass->states.data[k];
+        for (int c = 0; unique && c < 0x80; ++c)
+        {
+            onepass_edge_t *edge = &from->next[c];
+            edge->target = -1;
+            int match = -1;
+            for (int i = 0; i < from->nodes.length && c != 0 && c != 0x7F; ++i)
+            {
+                nfa_node_t *p = nfa->nfa.data[from->nodes.data[i]];
+                if (p->edge == c || (p->edge == EDGE_CHARACTER_CLASS && p->complement != bitset_get(p->bitset, c)))
+                {
+                    unique = match < 0;
+                    match = i;
+                }
+            }
+            if (match < 0 || !unique)
+            {
+                continue;
+            }
+            bitset_clear(visited);
+            vec_clear(&nodes);
+            vec_clear(&origins);
+            vec_clear(&sets);
+            nfa_node_t *p = nfa->nfa.data[from->nodes.data[match]];
+            unique = tdfa_closure(p->next[0], 0, visited, &nodes, &origins, &sets, seen);
+            edge->set = from->sets.data[match];
+            edge->target = onepass_state(nfa, onepass, &table, &nodes, &sets);
+        }
+        bytes += sizeof(onepass_state_t) + from->nodes.length * (sizeof(int) + sizeof(uint64_t));
+        fits = (!limits->max_states || (size_t)onepass->states.length <= limits->max_states) &&
+               (!limits->max_bytes || bytes <= limits->max_bytes);
+    }
+    vec_deinit(&nodes);
+    vec_deinit(&origins);
+    vec_deinit(&sets);
+    bitset_free(visited);
+    free(seen);
+    state_table_free(&table);
+    if (!unique || !fits)
+    {
+        onepass_free(onepass);
+        return NULL;
+    }
+    return onepass;
+}
+
+static bool onepass_match(const onepass_t *onepass, const char *text, size_t length, int *regs)
+{
+    // matches the whole of text, leaving tags registers in regs
+    for (int t = 0; t < onepass->tags; ++t)
+    {
+        regs[t] = -1;
+    }
+    onepass_state_t *state = onepass->states.data[0];
+    for (size_t k = 0; k < length; ++k)
+    {
+        unsigned char c = text[k];
+        const onepass_edge_t *edge = c < 0x80 ? &state->next[c] : NULL;
+        if (!edge || edge->target < 0)
+        {
+            return false;
+        }
+        for (uint64_t set = edge->set; set; set &= set - 1)
+        {
+            regs[__builtin_ctzll(set)] = (int)k;
+        }
+        state = onepass->states.data[edge->target];
+    }
+    if (!state->final)
+    {
+        return false;
+    }
+    for (uint64_t set = state->final_set; set; set &= set - 1)
+    {
+        regs[__builtin_ctzll(set)] = (int)length;
+    }
+    return true;
+}
+
+static void emit_comment(const char *comment, ...)
+{
+    va_list args;
+    va_start(args, comment);
+    while (comment)
+    {
+        printf("// %s\n", comment);
+        comment = va_arg(args, const char *);
+    }
+    va_end(args);
+}
+
+static void emit_yy_next(const char *name)
+{
+    emit_comment("yy_next(state, c) is given the current state and next character,", "and evaluates to the next state.",
+                 NULL);
+    printf("#define yy_next(state, c)    %s[state][c]\n", name);
+}
+
+static void emit_dfa_state_table(const dfa_t *dfa)
+{
+    printf("{\n");
+    printf("/* 00000 */ { ");
+    for (char c = 0; c < 0x7F; ++c)
+    {
+        printf("   -1, ");
+    }
+    printf("},\n");
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        dfa_node_t *node = dfa->data[i];
+        printf("/* %05d */ { ", i + 1);
+        for (char c = 0; c < 0x7F; ++c)
+        {
+            dfa_node_t *next = do_goto(node, c);
+            if (next)
+            {
+                printf("%5d, ", next->index);
+            }
+            else
+            {
+                printf("    0, ");
+            }
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+}
+
+#define NCOLS 10
+#define TYPE "YY_TTYPE"
+#define STORAGE_CLASS "YYPRIVATE"
+#define DECODING_ROUTINE_STORAGE_CLASS "YYPRIVATE"
+#define INDENT "          "
+
+static void dfa_free(dfa_t *dfa)
+{
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        bitset_free(dfa->data[i]->bitset);
+        if (dfa->data[i]->trail)
+        {
+            bitset_free(dfa->data[i]->trail);
+        }
+        if (dfa->data[i]->entry)
+        {
+            bitset_free(dfa->data[i]->entry);
+        }
+        vec_deinit(&dfa->data[i]->ranges);
+    }
+    vec_deinit(dfa);
+}
+
+typedef vec_t(vec_int_t) dtran_t;
+
+dtran_t make_dtran(const dfa_t *dfa)
+{
+    dtran_t result;
+    vec_init(&result);
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        vec_int_t dtran_row;
+        vec_init(&dtran_row);
+        for (int c = 0; c < 0x80; ++c)
+        {
+            vec_push(&dtran_row, -1);
+        }
+        for (int j = 0; j < dfa->data[i]->ranges.length; ++j)
+        {
+            const dfa_range_t *r = &dfa->data[i]->ranges.data[j];
+            for (int c = r->lo; c <= r->hi; ++c)
+            {
+                dtran_row.data[c] = r->next->index;
+            }
+        }
+        vec_push(&result, dtran_row);
+    }
+    return result;
+}
+
+static void show_dtran(const dtran_t *dtran)
+{
+    printf("{\n");
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        printf("  [%d] = { ", i);
+        for (int j = 0; j < dtran->data[i].length; ++j)
+        {
+            printf("%d, ", dtran->data[i].data[j]);
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+}
+
+static const char *bin_to_ascii(int c, bool use_hex)
+{
+    static char buf[8];
+    c &= 0xFF;
+    if (' ' <= c && c < 0x7F && c != '\'' && c != '\\')
+    {
+        buf[0] = c;
+        buf[1] = '\0';
+    }
+    else
+    {
+        buf[0] = '\\';
+        buf[2] = '\0';
+        switch (c)
+        {
+        case '\\':
+            buf[1] = '\\';
+            break;
+        case '\'':
+            buf[1] = '\'';
+            break;
+        case '\b':
+            buf[1] = 'b';
+            break;
+        case '\f':
+            buf[1] = 'f';
+            break;
+        case '\t':
+            buf[1] = 't';
+            break;
+        case '\r':
+            buf[1] = 'r';
+            break;
+        case '\n':
+            buf[1] = 'n';
+            break;
+        default:
+            sprintf(&buf[1], use_hex ? "x%03x" : "%03o", c);
+            break;
+        }
+    }
+    return buf;
+}
+
+static void printv(FILE *fp, const char **argv)
+{
+    while (*argv)
+    {
+        fprintf(fp, "%s\n", *argv++);
+    }
+}
+
+static void comment(FILE *fp, const char **argv)
+{
+    fprintf(fp, "\n/*---------------------------------------\n");
+    while (*argv)
+    {
+        fprintf(fp, " * %s\n", *argv++);
+    }
+    fprintf(fp, " */\n\n");
+}
+
+static int pairs(FILE *fp, const dtran_t *dtran, const char *name, int threshold, bool numbers)
+{
+    // https://stackoverflow.com/a/29960371
+
+    int num_cells = 0;
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        int ntransitions = 0;
+        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        {
+            if (*p != -1)
+            {
+                ++ntransitions;
+            }
+        }
+        if (ntransitions > 0)
+        {
+            fprintf(fp, "%s %s %s%-d[] = { ", STORAGE_CLASS, TYPE, name, i);
+            ++num_cells;
+            if (ntransitions > threshold)
+            {
+                fprintf(fp, "0,\n" INDENT);
+            }
+            else
+            {
+                fprintf(fp, "%5d, ", ntransitions);
+                if (threshold > 5)
+                {
+                    fprintf(fp, "\n" INDENT);
+                }
+            }
+
+            int nprinted = dtran->data[i].length;
+            int ncommas = ntransitions;
+            for (int *p = dtran->data[i].data, j = 0; j < dtran->data[i].length; ++j, ++p)
+            {
+                if (ntransitions > threshold)
+                {
+                    ++num_cells;
+                    --nprinted;
+                    fprintf(fp, "%5d", *p);
+                    if (j < dtran->data[i].length - 1)
+                    {
+                        fprintf(fp, ", ");
+                    }
+                }
+                else if (*p != -1)
+                {
+                    num_cells += 2;
+                    if (numbers)
+                    {
+                        fprintf(fp, "%d,%d", j, *p);
+                    }
+                    else
+                    {
+                        fprintf(fp, "'%s',%d", bin_to_ascii(j, 0), *p);
+                    }
+                    nprinted -= 2;
+                    if (--ncommas > 0)
+                    {
+                        fprintf(fp, ", ");
+                    }
+                }
+                if (nprinted <= 0)
+                {
+                    fprintf(fp, "\n" INDENT);
+                    nprinted = dtran->data[i].length;
+                }
+            }
+            fprintf(fp, "};\n");
+        }
+    }
+    fprintf(fp, "\n%s %s *%s[%d] =\n{\n" INDENT, STORAGE_CLASS, TYPE, name, dtran->length);
+    int nprinted = 10;
+    for (int i = 0; i < dtran->length - 1; ++i)
+    {
+        int ntransitions = 0;
+        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        {
+            if (*p != -1)
+            {
+                ++ntransitions;
+            }
+        }
+        fprintf(fp, ntransitions ? "%s%-d, " : "NULL, ", name, i);
+        if (--nprinted <= 0)
+        {
+            fprintf(fp, "\n" INDENT);
+            nprinted = 10;
+        }
+    }
+    fprintf(fp, "%s%-d\n};\n\n", name, dtran->length - 1);
+    return num_cells;
+}
+
+static void pnext(FILE *fp, const char *name)
+{
+    static const char *toptext[] = {
+        "Given the current state and the current input character, return ",
+        "the next state.",
+        NULL,
+    };
+    static const char *boptext[] = {
+        "  int i;", "  if (p)",
+        "  {",      "    if ((i = *p++) == 0)",
+        "    {",    "      return p[c];",
+        "    }",    "    for (; --i >= 0; p += 2)",
+        "    {",    "      if (c == p[0])",
+        "      {",  "        return p[1];",
+        "      }",  "    }",
+        "  }",      "  return YYF;",
+        "}",        NULL,
+    };
+    fprintf(fp, "\n/*------------------------------------------------*/\n");
+    fprintf(fp, "%s %s yy_next(int cur_state, unsigned int c)\n", DECODING_ROUTINE_STORAGE_CLASS, TYPE);
+    fprintf(fp, "{\n");
+    comment(fp, toptext);
+    fprintf(fp, "  %s *p = %s[cur_state];\n", TYPE, name);
+    printv(fp, boptext);
+}
+
+static int bitmap_pairs(FILE *fp, const dtran_t *dtran, const char *name)
+{
+    // every row becomes a 128-bit map of the characters that have a
+    // transition, and the targets of all rows are packed into one array.
+    // name_base holds where each half of a row starts in it, so a lookup
+    // is a bit test and one popcount
+    int ntargets = 0;
+    fprintf(fp, "%s unsigned long long %s_map[%d][2] =\n{\n", STORAGE_CLASS, name, dtran->length);
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        unsigned long long map[2] = {0, 0};
+        for (int c = 0; c < dtran->data[i].length && c < 0x80; ++c)
+        {
+            if (dtran->data[i].data[c] != -1)
+            {
+                map[c >> 6] |= 1ULL << (c & 63);
+            }
+        }
+        fprintf(fp, INDENT "{ 0x%016llxULL, 0x%016llxULL },\n", map[0], map[1]);
+    }
+    fprintf(fp, "};\n\n%s int %s_base[%d][2] =\n{\n", STORAGE_CLASS, name, dtran->length);
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        fprintf(fp, INDENT "{ %d, ", ntargets);
+        for (int c = 0; c < dtran->data[i].length && c < 0x80; ++c)
+        {
+            if (c == 0x40)
+            {
+                fprintf(fp, "%d },\n", ntargets);
+            }
+            if (dtran->data[i].data[c] != -1)
+            {
+                ++ntargets;
+            }
+        }
+    }
+    fprintf(fp, "};\n\n%s %s %s_targets[%d] =\n{\n" INDENT, STORAGE_CLASS, TYPE, name, ntargets ? ntargets : 1);
+    int nprinted = 10;
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        for (int c = 0; c < dtran->data[i].length && c < 0x80; ++c)
+        {
+            if (dtran->data[i].data[c] == -1)
+            {
+                continue;
+            }
+            fprintf(fp, "%5d, ", dtran->data[i].data[c]);
+            if (--nprinted <= 0)
+            {
+                fprintf(fp, "\n" INDENT);
+                nprinted = 10;
+            }
+        }
+    }
+    fprintf(fp, "%s\n};\n\n", ntargets ? "" : "0");
+    return 4 * dtran->length + ntargets;
+}
+
+static void bitmap_next(FILE *fp, const char *name)
+{
+    static const char *toptext[] = {
+        "Given the current state and the current input character, return ",
+        "the next state. The rank of c among the row's characters indexes ",
+        "the packed targets.",
+        NULL,
+    };
+    static const char *boptext[] = {
+        "  if (c >= 0x80 || !(word & bit))",
+        "  {",
+        "    return YYF;",
+        "  }",
+        NULL,
+    };
+    fprintf(fp, "\n/*------------------------------------------------*/\n");
+    fprintf(fp, "#ifndef YY_POPCOUNT\n#define YY_POPCOUNT(x) __builtin_popcountll(x)\n#endif\n\n");
+    fprintf(fp, "%s %s yy_next(int cur_state, unsigned int c)\n", DECODING_ROUTINE_STORAGE_CLASS, TYPE);
+    fprintf(fp, "{\n");
+    comment(fp, toptext);
+    fprintf(fp, "  unsigned long long bit = 1ULL << (c & 63);\n");
+    fprintf(fp, "  unsigned long long word = %s_map[cur_state][(c >> 6) & 1];\n", name);
+    printv(fp, boptext);
+    fprintf(fp, "  return %s_targets[%s_base[cur_state][c >> 6] + YY_POPCOUNT(word & (bit - 1))];\n", name, name);
+    fprintf(fp, "}\n");
+}
+
+typedef vec_t(dfa_t *) vec_dfa_t;
+
+// every start condition enters the machine through a chain of epsilon
+// nodes over its rules. a selector holds a second set of chains, one node
+// per rule and condition, that can be relinked to cover any subset of the
+// rules without adding nodes to the NFA
+typedef struct
+{
+    nfa_t *nfa;
+    vec_nfa_node_t links;
+    // the rule and start condition of each link
+    vec_int_t rules;
+    vec_int_t conditions;
+    // entry of a condition none of whose rules are selected
+    vec_nfa_node_t empty;
+    vec_int_t starts;
+} rule_selector_t;
+
+static void rule_selector_init(rule_selector_t *selector, nfa_t *nfa)
+{
+    selector->nfa = nfa;
+    vec_init(&selector->links);
+    vec_init(&selector->rules);
+    vec_init(&selector->conditions);
+    vec_init(&selector->empty);
+    vec_init(&selector->starts);
+    vec_extend(&selector->starts, &nfa->starts);
+    for (int c = 0; c < nfa->starts.length; ++c)
+    {
+        for (nfa_node_t *p = nfa->nfa.data[nfa->starts.data[c]]; p && p->next[0]; p = p->next[1])
+        {
+            int r = 0;
+            while (nfa->rules.data[r].start != p->next[0])
+            {
+                ++r;
+            }
+            nfa_node_t *link = append_nfa(nfa);
+            link->next[0] = p->next[0];
+            vec_push(&selector->links, link);
+            vec_push(&selector->rules, r);
+            vec_push(&selector->conditions, c);
+        }
+        vec_push(&selector->empty, append_nfa(nfa));
+    }
+}
+
+static void rule_selector_select(rule_selector_t *selector, const bitset_t *rules)
+{
+    // points the NFA's entries at chains over the given rules only
+    nfa_t *nfa = selector->nfa;
+    for (int c = 0; c < nfa->starts.length; ++c)
+    {
+        nfa_node_t *head = NULL;
+        nfa_node_t *last = NULL;
+        for (int i = 0; i < selector->links.length; ++i)
+        {
+            if (selector->conditions.data[i] != c || !bitset_get(rules, selector->rules.data[i]))
+            {
+                continue;
+            }
+            nfa_node_t *link = selector->links.data[i];
+            link->next[1] = NULL;
+            if (last)
+            {
+                last->next[1] = link;
+            }
+            else
+            {
+                head = link;
+            }
+            last = link;
+        }
+        nfa->starts.data[c] = (head ? head : selector->empty.data[c])->index;
+    }
+    nfa->start = nfa->starts.data[0];
+}
+
+static void rule_selector_free(rule_selector_t *selector)
+{
+    // the links stay in the NFA, unreachable once the entries are restored
+    nfa_t *nfa = selector->nfa;
+    for (int c = 0; c < nfa->starts.length; ++c)
+    {
+        nfa->starts.data[c] = selector->starts.data[c];
+    }
+    nfa->start = nfa->starts.data[0];
+    vec_deinit(&selector->links);
+    vec_deinit(&selector->rules);
+    vec_deinit(&selector->conditions);
+    vec_deinit(&selector->empty);
+    vec_deinit(&selector->starts);
+}
+
+static void rule_first_chars(const rule_t *r, uint64_t chars[2])
+{
+    // the characters a rule can begin with
+    chars[0] = chars[1] = 0;
+    bitset_t *visited = bitset_create();
+    vec_nfa_node_t stack;
+    vec_init(&stack);
+    vec_push(&stack, r->start);
+    while (stack.length > 0)
+    {
+        nfa_node_t *p = vec_pop(&stack);
+        if (bitset_get(visited, p->index))
+        {
+            continue;
+        }
+        bitset_set(visited, p->index);
+        if (nfa_consumes(p))
+        {
+            uint64_t node_chars[2];
+            nfa_node_chars(p, node_chars);
+            chars[0] |= node_chars[0];
+            chars[1] |= node_chars[1];
+            continue;
+        }
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j])
+            {
+                vec_push(&stack, p->next[j]);
+            }
+        }
+    }
+    vec_deinit(&stack);
+    bitset_free(visited);
+}
+
+static int rule_positions(const rule_t *r)
+{
+    // the nodes of a rule that consume a character, about the states it
+    // adds to a machine whose other rules it does not interact with
+    int positions = 0;
+    bitset_t *visited = bitset_create();
+    vec_nfa_node_t stack;
+    vec_init(&stack);
+    vec_push(&stack, r->start);
+    while (stack.length > 0)
+    {
+        nfa_node_t *p = vec_pop(&stack);
+        if (bitset_get(visited, p->index))
+        {
+            continue;
+        }
+        bitset_set(visited, p->index);
+        positions += nfa_consumes(p);
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j])
+            {
+                vec_push(&stack, p->next[j]);
+            }
+        }
+    }
+    vec_deinit(&stack);
+    bitset_free(visited);
+    return positions;
+}
+
+static void compile_shards(nfa_t *nfa, bool force, vec_dfa_t *shards)
+{
+    // one minimal DFA for all the rules if it stays under DFA_STATE_BUDGET
+    // states, otherwise one for each group of rules that does. rules are
+    // placed first fit by their positions, trying the groups whose first
+    // characters overlap theirs least before the others, since rules that
+    // cannot start on the same character hardly multiply each other's
+    // states. each group is then determinized once, and halved for as long
+    // as it still outgrows the budget, so the trials stay few however many
+    // rules there are
+    const dfa_limits_t budget = {DFA_STATE_BUDGET, DFA_MAX_BYTES};
+    dfa_t *dfa = nfa_to_dfa(nfa, &budget);
+    if (dfa)
+    {
+        vec_push(shards, minimize_dfa(dfa));
+        dfa_free(dfa);
+        return;
+    }
+
+    int nrules = nfa->rules.length;
+    rule_selector_t selector;
+    rule_selector_init(&selector, nfa);
+    bitset_t **members = calloc(nrules, sizeof(bitset_t *));
+    uint64_t(*chars)[2] = calloc(nrules, sizeof(*chars));
+    int *positions = calloc(nrules, sizeof(int));
+    int *order = malloc(sizeof(int) * nrules);
+    int groups = 0;
+    bitset_t *present = bitset_create();
+    for (int i = 0; i < selector.rules.length; ++i)
+    {
+        bitset_set(present, selector.rules.data[i]);
+    }
+    for (int r = 0; r < nrules; ++r)
+    {
+        if (!bitset_get(present, r))
+        {
+            // taken out of the machine, as keywords are
+            continue;
+        }
+        uint64_t first[2];
+        rule_first_chars(&nfa->rules.data[r], first);
+        int size = rule_positions(&nfa->rules.data[r]);
+        for (int g = 0; g < groups; ++g)
+        {
+            // insertion sort by overlap, stable so ties go to older groups
+            int overlap = __builtin_popcountll(first[0] & chars[g][0]) + __builtin_popcountll(first[1] & chars[g][1]);
+            int k = g;
+            for (; k > 0; --k)
+            {
+                int o = order[k - 1];
+                if (__builtin_popcountll(first[0] & chars[o][0]) + __builtin_popcountll(first[1] & chars[o][1]) <=
+                    overlap)
+                {
+                    break;
+                }
+                order[k] = o;
+            }
+            order[k] = g;
+        }
+        int g = 0;
+        while (g < groups && positions[order[g]] + size > DFA_STATE_BUDGET)
+        {
+            ++g;
+        }
+        int o = g < groups ? order[g] : groups++;
+        if (!members[o])
+        {
+            members[o] = bitset_create();
+        }
+        bitset_set(members[o], r);
+        positions[o] += size;
+        chars[o][0] |= first[0];
+        chars[o][1] |= first[1];
+    }
+    bitset_free(present);
+
+    // members is now a stack of the groups left to determinize; halving one
+    // replaces it with two, and there are never more groups than rules
+    while (groups > 0)
+    {
+        bitset_t *group = members[--groups];
+        rule_selector_select(&selector, group);
+        dfa = nfa_to_dfa(nfa, &budget);
+        size_t count = bitset_count(group);
+        if (!dfa && count > 1)
+        {
+            bitset_t *half = bitset_create();
+            size_t i = 0;
+            for (size_t k = 0; k < count / 2; ++k, ++i)
+            {
+                bitset_next_set_bit(group, &i);
+                bitset_set(half, i);
+            }
+            bitset_t *rest = bitset_create();
+            for (; bitset_next_set_bit(group, &i); ++i)
+            {
+                bitset_set(rest, i);
+            }
+            bitset_free(group);
+            members[groups++] = rest;
+            members[groups++] = half;
+            continue;
+        }
+        if (!dfa)
+        {
+            // a rule too big on its own is compiled as it stands, if -f
+            // allows it, up to the hard limits
+            size_t r = 0;
+            bitset_next_set_bit(group, &r);
+            if (!force)
+            {
+                fprintf(stderr, "Rule %zu alone needs more than %d DFA states; use -f to compile it anyway\n", r + 1,
+                        DFA_STATE_BUDGET);
+                exit(1);
+            }
+            dfa = nfa_to_dfa(nfa, &dfa_default_limits);
+            if (!dfa)
+            {
+                fprintf(stderr, "DFA grew past %zu states or %zu bytes\n", dfa_default_limits.max_states,
+                        dfa_default_limits.max_bytes);
+                exit(1);
+            }
+        }
+        vec_push(shards, minimize_dfa(dfa));
+        dfa_free(dfa);
+        bitset_free(group);
+    }
+    rule_selector_free(&selector);
+    free(order);
+    free(positions);
+    free(chars);
+    free(members);
+}
+
+// keyword rules: literals that a later, more general rule also matches
+// (if, while... against [a-z]+). they are dropped from the DFA, which then
+// needs no states for their prefixes, and kept in a minimal perfect hash
+// (hash and displace) that is looked up once a token is matched
+typedef struct
+{
+    int count;
+    // per bucket, the seed that sends its keywords to free slots
+    uint32_t *seeds;
+    // per slot
+    char **words;
+    size_t *lengths;
+    int *rules;
+    // start conditions the keyword is active in
+    bitset_t **conditions;
+    size_t min_length;
+    size_t max_length;
+    int min_rule;
+} keyword_table_t;
+
+static uint32_t keyword_hash(uint32_t seed, const char *text, size_t length)
+{
+    uint32_t hash = 2166136261u ^ (seed * 0x9E3779B9u);
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    // FNV alone spreads short keys poorly across seeds
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static int keyword_lookup(const keyword_table_t *table, int condition, const char *text, size_t length)
+{
+    // the keyword's rule, or 0
+    if (length < table->min_length || length > table->max_length)
+    {
+        return 0;
+    }
+    uint32_t bucket = keyword_hash(0, text, length) % table->count;
+    uint32_t slot = keyword_hash(table->seeds[bucket], text, length) % table->count;
+    if (table->lengths[slot] != length || memcmp(table->words[slot], text, length) != 0 ||
+        !bitset_get(table->conditions[slot], condition))
+    {
+        return 0;
+    }
+    return table->rules[slot];
+}
+
+static bool rule_literal(const rule_t *r, vec_char_t *literal)
+{
+    // true if the rule is a chain of plain characters, which are left in
+    // literal
+    vec_clear(literal);
+    if (r->anchor != ANCHOR_NONE || r->trail != TRAIL_NONE)
+    {
+        return false;
+    }
+    nfa_node_t *p = r->start;
+    for (; p && !p->accept && !p->next[1]; p = p->next[0])
+    {
+        if (p->edge == EDGE_CHARACTER_CLASS || p->edge == EDGE_EMPTY || p->edge == '\n')
+        {
+            return false;
+        }
+        if (p->edge != EDGE_EPSILON)
+        {
+            vec_push(literal, p->edge);
+        }
+    }
+    return p && p->accept && !p->next[0] && literal->length > 0;
+}
+
+static bool rule_matches(const nfa_t *nfa, int rule, const char *text, size_t length)
+{
+    // runs the rule's part of the NFA over text, a set of nodes at a time
+    vec_int_t current;
+    vec_int_t stack;
+    vec_init(&current);
+    vec_init(&stack);
+    bitset_t *seen = bitset_create();
+    vec_push(&stack, nfa->rules.data[rule].start->index);
+    bool accepted = false;
+    for (size_t i = 0; i <= length; ++i)
+    {
+        vec_clear(&current);
+        bitset_clear(seen);
+        while (stack.length > 0)
+        {
+            int n = vec_pop(&stack);
+            if (bitset_get(seen, n))
+            {
+                continue;
+            }
+            bitset_set(seen, n);
+            nfa_node_t *p = nfa->nfa.data[n];
+            if (p->edge != EDGE_EPSILON)
+            {
+                vec_push(&current, n);
+                continue;
+            }
+            accepted = accepted || (i == length && p->accept == rule + 1);
+            for (int j = 0; j <= 1; ++j)
+            {
+                if (p->next[j])
+                {
+                    vec_push(&stack, p->next[j]->index);
+                }
+            }
+        }
+        for (int k = 0; i < length && k < current.length; ++k)
+        {
+            nfa_node_t *p = nfa->nfa.data[current.data[k]];
+            int c = (unsigned char)text[i];
+            if (p->edge == EDGE_CHARACTER_CLASS ? c < 0x80 && p->complement != bitset_get(p->bitset, c)
+                                                : p->edge == c)
+            {
+                vec_push(&stack, p->next[0]->index);
+            }
+        }
+    }
+    vec_deinit(&current);
+    vec_deinit(&stack);
+    bitset_free(seen);
+    return accepted;
+}
+
+static void nfa_drop_rules(nfa_t *nfa, const bitset_t *drop)
+{
+    // relinks every start condition's chain over the rules that remain,
+    // reusing its nodes in order
+    vec_nfa_node_t links;
+    vec_nfa_node_t kept;
+    vec_init(&links);
+    vec_init(&kept);
+    for (int c = 0; c < nfa->starts.length; ++c)
+    {
+        vec_clear(&links);
+        vec_clear(&kept);
+        for (nfa_node_t *p = nfa->nfa.data[nfa->starts.data[c]]; p && p->next[0]; p = p->next[1])
+        {
+            int r = 0;
+            while (nfa->rules.data[r].start != p->next[0])
+            {
+                ++r;
+            }
+            vec_push(&links, p);
+            if (!bitset_get(drop, r))
+            {
+                vec_push(&kept, p->next[0]);
+            }
+        }
+        for (int k = 0; k < kept.length; ++k)
+        {
+            links.data[k]->next[0] = kept.data[k];
+            links.data[k]->next[1] = k + 1 < kept.length ? links.data[k + 1] : NULL;
+        }
+        if (kept.length == 0 && links.length > 0)
+        {
+            links.data[0]->next[0] = NULL;
+            links.data[0]->next[1] = NULL;
+        }
+    }
+    vec_deinit(&links);
+    vec_deinit(&kept);
+}
+
+static void keyword_table_free(keyword_table_t *table)
+{
+    for (int k = 0; k < table->count; ++k)
+    {
+        free(table->words[k]);
+        bitset_free(table->conditions[k]);
+    }
+    free(table->seeds);
+    free(table->words);
+    free(table->lengths);
+    free(table->rules);
+    free(table->conditions);
+}
+
+static void keyword_table_build(keyword_table_t *table, vec_str_t *words, vec_int_t *rules, bitset_t **conditions)
+{
+    // keywords are grouped into count buckets by one hash; the fullest
+    // buckets go first, each trying seeds for a second hash until all of
+    // its keywords land in free slots
+    int n = words->length;
+    table->count = n;
+    table->seeds = calloc(n, sizeof(uint32_t));
+    table->words = calloc(n, sizeof(char *));
+    table->lengths = calloc(n, sizeof(size_t));
+    table->rules = calloc(n, sizeof(int));
+    table->conditions = calloc(n, sizeof(bitset_t *));
+    table->min_length = SIZE_MAX;
+    table->max_length = 0;
+    table->min_rule = INT32_MAX;
+    vec_int_t *buckets = calloc(n, sizeof(vec_int_t));
+    int largest = 0;
+    for (int k = 0; k < n; ++k)
+    {
+        uint32_t b = keyword_hash(0, words->data[k], strlen(words->data[k])) % n;
+        vec_push(&buckets[b], k);
+        largest = buckets[b].length > largest ? buckets[b].length : largest;
+    }
+    uint32_t *slots = malloc(sizeof(uint32_t) * (largest ? largest : 1));
+    for (int size = largest; size > 0; --size)
+    {
+        for (int b = 0; b < n; ++b)
+        {
+            if (buckets[b].length != size)
+            {
+                continue;
+            }
+            for (uint32_t seed = 1;; ++seed)
+            {
+                int j = 0;
+                for (; j < size; ++j)
+                {
+                    const char *word = words->data[buckets[b].data[j]];
+                    slots[j] = keyword_hash(seed, word, strlen(word)) % n;
+                    bool taken = table->words[slots[j]] != NULL;
+                    for (int i = 0; i < j && !taken; ++i)
+                    {
+                        taken = slots[i] == slots[j];
+                    }
+                    if (taken)
+                    {
+                        break;
+                    }
+                }
+                if (j == size)
+                {
+                    table->seeds[b] = seed;
+                    break;
+                }
+            }
+            for (int j = 0; j < size; ++j)
+            {
+                int k = buckets[b].data[j];
+                size_t length = strlen(words->data[k]);
+                table->words[slots[j]] = words->data[k];
+                table->lengths[slots[j]] = length;
+                table->rules[slots[j]] = rules->data[k];
+                table->conditions[slots[j]] = conditions[k];
+                table->min_length = length < table->min_length ? length : table->min_length;
+                table->max_length = length > table->max_length ? length : table->max_length;
+                table->min_rule = rules->data[k] < table->min_rule ? rules->data[k] : table->min_rule;
+            }
+        }
+    }
+    for (int b = 0; b < n; ++b)
+    {
+        vec_deinit(&buckets[b]);
+    }
+    free(buckets);
+    free(slots);
+}
+
+static keyword_table_t *extract_keywords(nfa_t *nfa)
+{
+    // NULL if no rule is a keyword. a keyword needs a rule other than a
+    // literal that matches it too, in every start condition it is active
+    // in. the longest match is then the same without the keyword, and it
+    // wins where the table says its rule comes first
+    int nrules = nfa->rules.length;
+    bitset_t **active = malloc(sizeof(bitset_t *) * (nrules ? nrules : 1));
+    bool *literal = calloc(nrules ? nrules : 1, sizeof(bool));
+    vec_char_t text;
+    vec_init(&text);
+    for (int r = 0; r < nrules; ++r)
+    {
+        active[r] = bitset_create();
+        literal[r] = rule_literal(&nfa->rules.data[r], &text);
+    }
+    for (int c = 0; c < nfa->starts.length; ++c)
+    {
+        for (nfa_node_t *p = nfa->nfa.data[nfa->starts.data[c]]; p && p->next[0]; p = p->next[1])
+        {
+            int r = 0;
+            while (nfa->rules.data[r].start != p->next[0])
+            {
+                ++r;
+            }
+            bitset_set(active[r], c);
+        }
+    }
+
+    vec_str_t words;
+    vec_int_t rules;
+    vec_init(&words);
+    vec_init(&rules);
+    bitset_t **conditions = malloc(sizeof(bitset_t *) * (nrules ? nrules : 1));
+    bitset_t *drop = bitset_create();
+    for (int r = 0; r < nrules; ++r)
+    {
+        if (!literal[r])
+        {
+            continue;
+        }
+        rule_literal(&nfa->rules.data[r], &text);
+        bool duplicate = false;
+        for (int k = 0; k < words.length && !duplicate; ++k)
+        {
+            duplicate =
+                strlen(words.data[k]) == (size_t)text.length && memcmp(words.data[k], text.data, text.length) == 0;
+        }
+        int g = 0;
+        for (; !duplicate && g < nrules; ++g)
+        {
+            const rule_t *general = &nfa->rules.data[g];
+            if (!literal[g] && general->anchor == ANCHOR_NONE && general->trail == TRAIL_NONE &&
+                bitset_intersection_count(active[r], active[g]) == bitset_count(active[r]) &&
+                rule_matches(nfa, g, text.data, text.length))
+            {
+                break;
+            }
+        }
+        if (duplicate || g == nrules)
+        {
+            continue;
+        }
+        conditions[words.length] = bitset_copy(active[r]);
+        vec_push(&words, copy_string(text.data, text.length));
+        vec_push(&rules, r + 1);
+        bitset_set(drop, r);
+    }
+
+    keyword_table_t *table = NULL;
+    if (words.length > 0)
+    {
+        table = GC_malloc(sizeof(keyword_table_t));
+        keyword_table_build(table, &words, &rules, conditions);
+        nfa_drop_rules(nfa, drop);
+    }
+    for (int r = 0; r < nrules; ++r)
+    {
+        bitset_free(active[r]);
+    }
+    bitset_free(drop);
+    free(conditions);
+    free(active);
+    free(literal);
+    vec_deinit(&text);
+    vec_deinit(&words);
+    vec_deinit(&rules);
+    return table;
+}
+
+// the byte a sentinel-terminated input buffer ends with; read_file leaves
+// one after everything it reads
+#define SCAN_SENTINEL '\0'
+// entries of scanner_t.fast that are not states
+#define FAST_DEAD (-1)
+#define FAST_END_CHECK (-2)
+
+typedef struct scanner_t
+{
+    // the current start condition
+    int condition;
+    // whether a line begins where the next token starts, and how far past
+    // the plain entries the ones with the ^ rules sit (0 if there are none)
+    bool bol;
+    int line_entries;
+    // DFAs stepped side by side, their states numbered one after another
+    int groups;
+    // entry state of every group in every start condition, INITIAL first
+    vec_int_t starts;
+    vec_str_t conditions;
+    int nstates;
+    // nstates rows of 0x80 entries, -1 where there is no transition
+    int *next;
+    // for input that ends in SCAN_SENTINEL: nstates rows of 0x100 entries,
+    // with FAST_DEAD for the bytes above 0x7F and FAST_END_CHECK in the
+    // sentinel's column. NULL when not in use
+    int *fast;
+    int *accept;
+    bitset_t **trail;
+    vec_rule_t rules;
+    // the reversed tail of each TRAIL_VARIABLE rule, NULL otherwise
+    vec_t(struct scanner_t *) tails;
+    // the state of every group after each character of the current token,
+    // kept only when some rule has variable trailing context
+    bool keep_path;
+    vec_int_t path;
+    // the state of every group while matching
+    int *states;
+    // literal rules left out of the DFA, or NULL
+    keyword_table_t *keywords;
+    // the last token ran into the end of the input while the machine was
+    // still alive, so more input could have made it longer
+    bool exhausted;
+    // one past the last character the last token read, lookahead included
+    size_t scanned;
+} scanner_t;
+
+typedef struct
+{
+    // 0 for a character that no rule matches
+    int rule;
+    size_t start;
+    size_t length;
+} token_t;
+
+static scanner_t *make_scanner(nfa_t *nfa, dfa_t *const *dfas, int groups)
+{
+    scanner_t *scanner = GC_malloc(sizeof(scanner_t));
+    scanner->condition = 0;
+    scanner->bol = true;
+    scanner->line_entries = nfa->starts.length > nfa->conditions.length ? nfa->conditions.length : 0;
+    scanner->groups = groups;
+    scanner->nstates = 0;
+    for (int g = 0; g < groups; ++g)
+    {
+        scanner->nstates += dfas[g]->length;
+    }
+    scanner->next = malloc(sizeof(int) * 0x80 * scanner->nstates);
+    scanner->accept = malloc(sizeof(int) * scanner->nstates);
+    scanner->trail = malloc(sizeof(bitset_t *) * scanner->nstates);
+    scanner->states = malloc(sizeof(int) * groups);
+    scanner->keywords = NULL;
+    scanner->fast = NULL;
+    vec_init(&scanner->starts);
+    vec_init(&scanner->conditions);
+    for (int c = 0; c < nfa->starts.length * groups; ++c)
+    {
+        vec_push(&scanner->starts, 0);
+    }
+    for (int g = 0, offset = 0; g < groups; offset += dfas[g]->length, ++g)
+    {
+        const dfa_t *dfa = dfas[g];
+        dtran_t dtran = make_dtran(dfa);
+        for (int i = 0; i < dfa->length; ++i)
+        {
+            int *row = &scanner->next[(offset + i) * 0x80];
+            for (int c = 0; c < 0x80; ++c)
+            {
+                row[c] = dtran.data[i].data[c] < 0 ? -1 : dtran.data[i].data[c] + offset;
+            }
+            scanner->accept[offset + i] = dfa->data[i]->accept;
+            scanner->trail[offset + i] = dfa->data[i]->trail ? bitset_copy(dfa->data[i]->trail) : NULL;
+            vec_deinit(&dtran.data[i]);
+            for (int c = 0; dfa->data[i]->entry && c < nfa->starts.length; ++c)
+            {
+                if (bitset_get(dfa->data[i]->entry, c))
+                {
+                    scanner->starts.data[c * groups + g] = offset + i;
+                }
+            }
+        }
+        vec_deinit(&dtran);
+    }
+    for (int c = 0; c < nfa->conditions.length; ++c)
+    {
+        vec_push(&scanner->conditions, copy_string(nfa->conditions.data[c], strlen(nfa->conditions.data[c])));
+    }
+
+    vec_init(&scanner->rules);
+    vec_init(&scanner->tails);
+    vec_init(&scanner->path);
+    for (int i = 0; i < nfa->rules.length; ++i)
+    {
+        rule_t r = nfa->rules.data[i];
+        scanner_t *tail = NULL;
+        if (r.trail == TRAIL_VARIABLE)
+        {
+            dfa_t *dfa = nfa_to_dfa(r.tail, NULL);
+            dfa_t *min = minimize_dfa(dfa);
+            tail = make_scanner(r.tail, &min, 1);
+            dfa_free(min);
+            dfa_free(dfa);
+            scanner->keep_path = true;
+        }
+        vec_push(&scanner->rules, r);
+        vec_push(&scanner->tails, tail);
+    }
+    return scanner;
+}
+
+static void scanner_free(scanner_t *scanner)
+{
+    for (int i = 0; i < scanner->nstates; ++i)
+    {
+        if (scanner->trail[i])
+        {
+            bitset_free(scanner->trail[i]);
+        }
+    }
+    for (int i = 0; i < scanner->tails.length; ++i)
+    {
+        if (scanner->tails.data[i])
+        {
+            scanner_free(scanner->tails.data[i]);
+        }
+    }
+    for (int c = 0; c < scanner->conditions.length; ++c)
+    {
+        free(scanner->conditions.data[c]);
+    }
+    free(scanner->next);
+    free(scanner->fast);
+    free(scanner->accept);
+    free(scanner->trail);
+    free(scanner->states);
+    if (scanner->keywords)
+    {
+        keyword_table_free(scanner->keywords);
+    }
+    vec_deinit(&scanner->starts);
+    vec_deinit(&scanner->conditions);
+    vec_deinit(&scanner->rules);
+    vec_deinit(&scanner->tails);
+    vec_deinit(&scanner->path);
+}
+
+static int scanner_next(const scanner_t *scanner, int state, unsigned char c)
+{
+    return c < 0x80 ? scanner->next[state * 0x80 + c] : -1;
+}
+
+static void scanner_use_sentinel(scanner_t *scanner)
+{
+    // every buffer passed to scan from now on has SCAN_SENTINEL at
+    // input[length]. only the single-table scanner without a path to keep
+    // has a loop that makes use of it
+    if (scanner->fast || scanner->groups > 1 || scanner->keep_path)
+    {
+        return;
+    }
+    scanner->fast = malloc(sizeof(int) * 0x100 * scanner->nstates);
+    for (int s = 0; s < scanner->nstates; ++s)
+    {
+        int *row = &scanner->fast[s * 0x100];
+        for (int c = 0; c < 0x100; ++c)
+        {
+            row[c] = c < 0x80 ? scanner->next[s * 0x80 + c] : FAST_DEAD;
+        }
+        row[(unsigned char)SCAN_SENTINEL] = FAST_END_CHECK;
+    }
+}
+
+static int scanner_condition(const scanner_t *scanner, const char *name)
+{
+    for (int c = 0; c < scanner->conditions.length; ++c)
+    {
+        if (strcmp(scanner->conditions.data[c], name) == 0)
+        {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static void scanner_begin(scanner_t *scanner, int condition)
+{
+    // all start conditions share one table, so changing modes only moves
+    // the state the next token starts from
+    scanner->condition = condition;
+}
+
+static int scanner_entry(const scanner_t *scanner)
+{
+    // the entry the next token starts from
+    return scanner->condition + (scanner->bol ? scanner->line_entries : 0);
+}
+
+static size_t trail_end(scanner_t *scanner, int accept, int group, const char *input, size_t start, size_t end)
+{
+    // walk the reversed tail back from the end of the match; the first
+    // position where s is complete and r could have ended is where r ends.
+    // the walk never leaves the token, so nothing is scanned twice
+    const scanner_t *tail = scanner->tails.data[accept - 1];
+    int state = tail->starts.data[0];
+    for (size_t q = end; state >= 0; --q)
+    {
+        int head = scanner->path.data[(q - start) * scanner->groups + group];
+        if (tail->accept[state] && scanner->trail[head] && bitset_get(scanner->trail[head], accept))
+        {
+            return q;
+        }
+        if (q == start)
+        {
+            break;
+        }
+        state = scanner_next(tail, state, input[q - 1]);
+    }
+    return end;
+}
+
+static size_t match_groups(scanner_t *scanner, const char *input, size_t start, size_t length, int *accept,
+                           int *group)
+{
+    // every group takes each character in turn. the longest match wins, and
+    // of the groups that match that far, the one with the lowest rule
+    int groups = scanner->groups;
+    int *states = scanner->states;
+    memcpy(states, &scanner->starts.data[scanner_entry(scanner) * groups], sizeof(int) * groups);
+    int alive = groups;
+    size_t end = start;
+    for (int g = 0; scanner->keep_path && g < groups; ++g)
+    {
+        vec_push(&scanner->path, states[g]);
+    }
+    size_t i = start;
+    for (; i < length && alive > 0; ++i)
+    {
+        for (int g = 0; g < groups; ++g)
+        {
+            if (states[g] >= 0)
+            {
+                states[g] = scanner_next(scanner, states[g], input[i]);
+                if (states[g] < 0)
+                {
+                    --alive;
+                }
+                else if (scanner->accept[states[g]] && (end <= i || scanner->accept[states[g]] < *accept))
+                {
+                    *accept = scanner->accept[states[g]];
+                    *group = g;
+                    end = i + 1;
+                }
+            }
+            if (scanner->keep_path)
+            {
+                vec_push(&scanner->path, states[g]);
+            }
+        }
+    }
+    scanner->exhausted = alive > 0;
+    scanner->scanned = i;
+    return end;
+}
+
+// one transition of scan_sentinel. anything but a move to a live state
+// leaves the unrolled loop
+#define SENTINEL_STEP()                                                                                                \
+    if ((next = fast[state * 0x100 + p[i]]) < 0)                                                                       \
+    {                                                                                                                  \
+        break;                                                                                                         \
+    }                                                                                                                  \
+    state = next;                                                                                                      \
+    ++i;                                                                                                               \
+    if (accepts[state])                                                                                                \
+    {                                                                                                                  \
+        *accept = accepts[state];                                                                                      \
+        end = i;                                                                                                       \
+    }
+
+static size_t scan_sentinel(scanner_t *scanner, const char *input, size_t length, size_t start, int *accept)
+{
+    // the sentinel after the input sends every state to FAST_END_CHECK, so
+    // the loop tests nothing but the entry it loads. a sentinel byte inside
+    // the input is told apart by its position and takes its real transition
+    const int *fast = scanner->fast;
+    const int *accepts = scanner->accept;
+    const unsigned char *p = (const unsigned char *)input;
+    int state = scanner->starts.data[scanner_entry(scanner)];
+    int next;
+    size_t i = start;
+    size_t end = start;
+    for (;;)
+    {
+        for (;;)
+        {
+            SENTINEL_STEP();
+            SENTINEL_STEP();
+            SENTINEL_STEP();
+            SENTINEL_STEP();
+        }
+        if (next == FAST_DEAD || i == length)
+        {
+            break;
+        }
+        if ((next = scanner->next[state * 0x80 + (unsigned char)SCAN_SENTINEL]) < 0)
+        {
+            break;
+        }
+        state = next;
+        ++i;
+        if (accepts[state])
+        {
+            *accept = accepts[state];
+            end = i;
+        }
+    }
+    scanner->exhausted = next == FAST_END_CHECK;
+    scanner->scanned = scanner->exhausted ? length : i + 1;
+    return end;
+}
+
+static bool scan(scanner_t *scanner, const char *input, size_t length, size_t *pos, token_t *token)
+{
+    // longest match from *pos, then the anchors and trailing context of the
+    // winning rule decide what part of the match is the token
+    if (*pos >= length)
+    {
+        return false;
+    }
+    size_t start = *pos;
+    size_t end = start;
+    int accept = 0;
+    int group = 0;
+    if (start > 0)
+    {
+        // at the start of a buffer, bol is whatever the last one ended with
+        scanner->bol = input[start - 1] == '\n';
+    }
+    bool keep_path = scanner->keep_path;
+    vec_clear(&scanner->path);
+    if (scanner->groups > 1)
+    {
+        end = match_groups(scanner, input, start, length, &accept, &group);
+    }
+    else if (scanner->fast)
+    {
+        end = scan_sentinel(scanner, input, length, start, &accept);
+    }
+    else
+    {
+        int state = scanner->starts.data[scanner_entry(scanner)];
+        if (keep_path)
+        {
+            vec_push(&scanner->path, state);
+        }
+        size_t i = start;
+        for (; i < length; ++i)
+        {
+            state = scanner_next(scanner, state, input[i]);
+            if (state < 0)
+            {
+                break;
+            }
+            if (keep_path)
+            {
+                vec_push(&scanner->path, state);
+            }
+            if (scanner->accept[state])
+            {
+                accept = scanner->accept[state];
+                end = i + 1;
+            }
+        }
+        scanner->exhausted = state >= 0;
+        scanner->scanned = scanner->exhausted ? length : i + 1;
+    }
+
+    if (accept > (scanner->keywords ? scanner->keywords->min_rule : INT32_MAX))
+    {
+        int keyword = keyword_lookup(scanner->keywords, scanner_entry(scanner), input + start, end - start);
+        accept = keyword && keyword < accept ? keyword : accept;
+    }
+    token->rule = accept;
+    if (!accept)
+    {
+        token->start = start;
+        token->length = 1;
+        *pos = start + 1;
+        return true;
+    }
+
+    rule_t *r = &scanner->rules.data[accept - 1];
+    switch (r->trail)
+    {
+    case TRAIL_FIXED_TAIL:
+        end -= r->trail_length;
+        break;
+    case TRAIL_FIXED_HEAD:
+        end = start + r->trail_length;
+        break;
+    case TRAIL_VARIABLE:
+        end = trail_end(scanner, accept, group, input, start, (r->anchor & ANCHOR_EOL) ? end - 1 : end);
+        break;
+    default:
+        if (r->anchor & ANCHOR_EOL)
+        {
+            // push back the newline
+            --end;
+        }
+        break;
+    }
+    if (end <= start)
+    {
+        // r matched nothing, so the character is passed through unmatched
+        // rather than scanned forever
+        token->rule = 0;
+        end = start + 1;
+    }
+    *pos = end;
+    token->start = start;
+    token->length = end - start;
+    return true;
+}
+
+static char *read_file(FILE *fp, size_t *length)
+{
+    size_t capacity = 0x1000;
+    char *buffer = malloc(capacity);
+    *length = 0;
+    size_t n;
+    while ((n = fread(buffer + *length, 1, capacity - *length - 1, fp)) > 0)
+    {
+        *length += n;
+        if (capacity - *length - 1 == 0)
+        {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    buffer[*length] = '\0';
+    return buffer;
+}
+
+// the newlines of a text, one bit per byte found 64 bytes at a time, with
+// the number of newlines in front of every 64-byte block. scanning only
+// deals in byte offsets; this turns one into a line and column, a rank
+// and then a select, when a report asks for it
+typedef struct
+{
+    uint64_t *bits;
+    // newlines in front of each block, then the total
+    size_t *before;
+    size_t blocks;
+} line_index_t;
+
+static void line_index_init(line_index_t *index, const char *text, size_t length)
+{
+    size_t full = length / 64;
+    index->blocks = (length + 63) / 64;
+    index->bits = calloc(index->blocks + 1, sizeof(uint64_t));
+    index->before = malloc((index->blocks + 1) * sizeof(size_t));
+#ifdef __SSE2__
+    __m128i newline = _mm_set1_epi8('\n');
+    for (size_t b = 0; b < full; ++b)
+    {
+        const __m128i *p = (const __m128i *)(text + b * 64);
+        uint64_t word = 0;
+        for (int k = 0; k < 4; ++k)
+        {
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + k), newline));
+            word |= (uint64_t)mask << (16 * k);
+        }
+        index->bits[b] = word;
+    }
+#else
+    for (size_t i = 0; i < full * 64; ++i)
+    {
+        index->bits[i / 64] |= (uint64_t)(text[i] == '\n') << (i & 63);
+    }
+#endif
+    for (size_t i = full * 64; i < length; ++i)
+    {
+        index->bits[full] |= (uint64_t)(text[i] == '\n') << (i & 63);
+    }
+    size_t count = 0;
+    for (size_t b = 0; b < index->blocks; ++b)
+    {
+        index->before[b] = count;
+        count += __builtin_popcountll(index->bits[b]);
+    }
+    index->before[index->blocks] = count;
+}
+
+static void line_index_free(line_index_t *index)
+{
+    free(index->bits);
+    free(index->before);
+}
+
+static size_t line_index_rank(const line_index_t *index, size_t offset)
+{
+    // newlines in front of offset
+    size_t b = offset / 64;
+    if (b >= index->blocks)
+    {
+        return index->before[index->blocks];
+    }
+    uint64_t below = ((uint64_t)1 << (offset & 63)) - 1;
+    return index->before[b] + __builtin_popcountll(index->bits[b] & below);
+}
+
+static size_t line_index_select(const line_index_t *index, size_t n)
+{
+    // the offset of newline n, from 0, which must exist: the last block
+    // with at most n newlines in front of it holds it
+    size_t lo = 0;
+    size_t hi = index->blocks;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->before[mid] <= n)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    uint64_t word = index->bits[lo];
+    for (size_t k = n - index->before[lo]; k > 0; --k)
+    {
+        word &= word - 1;
+    }
+    return lo * 64 + __builtin_ctzll(word);
+}
+
+static void line_index_find(const line_index_t *index, size_t offset, size_t *line, size_t *column)
+{
+    // both from 1
+    size_t rank = line_index_rank(index, offset);
+    *line = rank + 1;
+    *column = rank ? offset - line_index_select(index, rank - 1) : offset + 1;
+}
+
+static void print_token_chars(FILE *fp, const token_t *token, const char *text)
+{
+    fprintf(fp, "%zu \"", token->length);
+    for (size_t i = 0; i < token->length; ++i)
+    {
+        fprintf(fp, "%s", bin_to_ascii(text[i], false));
+    }
+    fprintf(fp, "\"\n");
+}
+
+static void print_token_text(FILE *fp, const token_t *token, const char *text)
+{
+    fprintf(fp, "%d %zu ", token->rule, token->start);
+    print_token_chars(fp, token, text);
+}
+
+static void print_token(FILE *fp, const char *input, const token_t *token)
+{
+    print_token_text(fp, token, input + token->start);
+}
+
+static void print_token_at(FILE *fp, const char *input, const token_t *token, const line_index_t *lines)
+{
+    // with lines, the start is given as line:column instead of an offset
+    if (!lines)
+    {
+        print_token(fp, input, token);
+        return;
+    }
+    size_t line;
+    size_t column;
+    line_index_find(lines, token->start, &line, &column);
+    fprintf(fp, "%d %zu:%zu ", token->rule, line, column);
+    print_token_chars(fp, token, input + token->start);
+}
+
+static void run_action(scanner_t *scanner, const char *action)
+{
+    // the scanner itself only understands BEGIN(NAME) and BEGIN NAME
+    if (!action || strncmp(action, "BEGIN", 5) != 0)
+    {
+        return;
+    }
+    const char *name = action + 5;
+    while (*name == ' ' || *name == '\t' || *name == '(')
+    {
+        ++name;
+    }
+    size_t length = 0;
+    while (isalnum((unsigned char)name[length]) || name[length] == '_')
+    {
+        ++length;
+    }
+    char *condition = copy_string(name, length);
+    int c = scanner_condition(scanner, condition);
+    if (c < 0)
+    {
+        fprintf(stderr, "unknown start condition '%s'\n", condition);
+        exit(1);
+    }
+    scanner_begin(scanner, c);
+    free(condition);
+}
+
+// tokens handed out column by column, a batch at a time, for callers that
+// would rather walk dense arrays than take one token_t per call. starts are
+// relative to base, the position the batch began at, so they fit in 32 bits
+// however long the input is
+#define COLUMNS_BATCH 4096
+
+typedef struct
+{
+    uint16_t *kind;
+    uint32_t *start;
+    uint32_t *length;
+    size_t capacity;
+    size_t count;
+    size_t base;
+} token_columns_t;
+
+static void token_columns_init(token_columns_t *columns, const scanner_t *scanner, size_t capacity)
+{
+    if (scanner->rules.length > UINT16_MAX)
+    {
+        fprintf(stderr, "too many rules for 16-bit token kinds\n");
+        exit(1);
+    }
+    columns->kind = malloc(capacity * sizeof(uint16_t));
+    columns->start = malloc(capacity * sizeof(uint32_t));
+    columns->length = malloc(capacity * sizeof(uint32_t));
+    columns->capacity = capacity;
+    columns->count = 0;
+    columns->base = 0;
+}
+
+static void token_columns_free(token_columns_t *columns)
+{
+    free(columns->kind);
+    free(columns->start);
+    free(columns->length);
+}
+
+static size_t scan_columns(scanner_t *scanner, const char *input, size_t length, size_t *pos, token_columns_t *out)
+{
+    // fills out with up to capacity tokens from *pos, running their
+    // actions on the way since a BEGIN changes how the next token scans.
+    // the batch ends early once it covers 2GB, which keeps the offsets in
+    // 32 bits for any token shorter than that
+    out->count = 0;
+    out->base = *pos;
+    token_t token;
+    while (out->count < out->capacity && *pos - out->base < INT32_MAX && scan(scanner, input, length, pos, &token))
+    {
+        out->kind[out->count] = token.rule;
+        out->start[out->count] = token.start - out->base;
+        out->length[out->count] = token.length;
+        ++out->count;
+        if (token.rule)
+        {
+            run_action(scanner, scanner->rules.data[token.rule - 1].action);
+        }
+    }
+    return out->count;
+}
+
+// a token stream kept up to date as its text is edited. the scanner only
+// carries the start condition from one token to the next, so a token
+// boundary plus the condition there, and whether a line begins there, is a
+// complete checkpoint: once re-lexing reaches an old boundary past the edit
+// in the same state, everything after it is unchanged. the tokens sit in a gap buffer with
+// the gap at the last edit; positions behind the gap are kept relative to
+// the end of the text, so an edit doesn't renumber the rest of the file
+typedef struct
+{
+    // where the scan producing the token started: an offset from the start
+    // of the text in front of the gap, and from its end behind it
+    size_t pos;
+    // characters read past pos, plus one if the token ran into the end of
+    // the text; an edit before pos + lookahead can change the token
+    size_t lookahead;
+    int condition;
+    bool bol;
+    int rule;
+    size_t length;
+} relex_token_t;
+
+typedef struct
+{
+    scanner_t *scanner;
+    relex_token_t *tokens;
+    size_t count;
+    size_t capacity;
+    // tokens [0, gap) come first in the array, the others last
+    size_t gap;
+    size_t length;
+    // the condition after the last token
+    int condition;
+    // the largest lookahead of any token so far, which bounds how far in
+    // front of an edit the first affected token can start
+    size_t max_lookahead;
+} relex_t;
+
+static void relex_init(relex_t *relex, scanner_t *scanner)
+{
+    relex->scanner = scanner;
+    relex->tokens = NULL;
+    relex->count = 0;
+    relex->capacity = 0;
+    relex->gap = 0;
+    relex->length = 0;
+    relex->condition = scanner->condition;
+    relex->max_lookahead = 0;
+}
+
+static void relex_free(relex_t *relex)
+{
+    free(relex->tokens);
+}
+
+static relex_token_t *relex_slot(const relex_t *relex, size_t i)
+{
+    return &relex->tokens[i < relex->gap ? i : i + relex->capacity - relex->count];
+}
+
+static size_t relex_pos(const relex_t *relex, size_t i)
+{
+    size_t pos = relex_slot(relex, i)->pos;
+    return i < relex->gap ? pos : relex->length - pos;
+}
+
+static void relex_token(const relex_t *relex, size_t i, token_t *token)
+{
+    const relex_token_t *t = relex_slot(relex, i);
+    token->rule = t->rule;
+    token->start = relex_pos(relex, i);
+    token->length = t->length;
+}
+
+static void relex_move_gap(relex_t *relex, size_t gap)
+{
+    size_t width = relex->capacity - relex->count;
+    for (; relex->gap > gap; --relex->gap)
+    {
+        relex_token_t *t = &relex->tokens[relex->gap - 1 + width];
+        *t = relex->tokens[relex->gap - 1];
+        t->pos = relex->length - t->pos;
+    }
+    for (; relex->gap < gap; ++relex->gap)
+    {
+        relex_token_t *t = &relex->tokens[relex->gap];
+        *t = relex->tokens[relex->gap + width];
+        t->pos = relex->length - t->pos;
+    }
+}
+
+static void relex_push(relex_t *relex, const relex_token_t *token)
+{
+    // inserts at the gap, growing it if it is full
+    if (relex->count == relex->capacity)
+    {
+        size_t capacity = relex->capacity ? relex->capacity * 2 : 0x400;
+        size_t behind = relex->count - relex->gap;
+        relex->tokens = realloc(relex->tokens, sizeof(relex_token_t) * capacity);
+        memmove(&relex->tokens[capacity - behind], &relex->tokens[relex->capacity - behind],
+                sizeof(relex_token_t) * behind);
+        relex->capacity = capacity;
+    }
+    relex->tokens[relex->gap++] = *token;
+    ++relex->count;
+}
+
+static size_t relex_edit(relex_t *relex, const char *input, size_t length, size_t at, size_t inserted,
+                         size_t *first, size_t *replaced)
+{
+    // input is the text after some characters at `at` were replaced by
+    // `inserted` new ones; how many went follows from the change in length.
+    // the tokens [*first, *first + *replaced) of the old stream are replaced
+    // by the returned number of tokens from *first on, which relex_token
+    // reads back
+    size_t lo = 0;
+    size_t hi = relex->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (relex_pos(relex, mid) <= at)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    // lo is the first token starting after the edit. the first one whose
+    // lookahead reaches it can only be max_lookahead characters further back
+    size_t f = lo;
+    for (size_t i = lo; i > 0; --i)
+    {
+        size_t pos = relex_pos(relex, i - 1);
+        if (pos + relex->max_lookahead <= at)
+        {
+            break;
+        }
+        if (pos + relex_slot(relex, i - 1)->lookahead > at)
+        {
+            f = i - 1;
+        }
+    }
+    relex_move_gap(relex, f);
+    size_t pos = f < relex->count ? relex_pos(relex, f) : relex->length;
+    int condition = f < relex->count ? relex_slot(relex, f)->condition : relex->condition;
+    relex->length = length;
+
+    // old tokens behind the gap now have their positions in the new text,
+    // and those starting at or after at + inserted are checkpoints to sync on
+    scanner_t *scanner = relex->scanner;
+    scanner_begin(scanner, condition);
+    size_t fresh = 0;
+    *first = f;
+    *replaced = 0;
+    for (;;)
+    {
+        while (relex->gap < relex->count && relex_pos(relex, relex->gap) < pos)
+        {
+            --relex->count;
+            ++*replaced;
+        }
+        bool bol = pos == 0 || input[pos - 1] == '\n';
+        if (relex->gap < relex->count && relex_pos(relex, relex->gap) == pos && pos >= at + inserted &&
+            relex_slot(relex, relex->gap)->condition == scanner->condition && relex_slot(relex, relex->gap)->bol == bol)
+        {
+            return fresh;
+        }
+        relex_token_t t;
+        t.pos = pos;
+        t.condition = scanner->condition;
+        t.bol = bol;
+        scanner->bol = bol;
+        token_t token;
+        if (!scan(scanner, input, length, &pos, &token))
+        {
+            break;
+        }
+        t.lookahead = scanner->scanned - t.pos + scanner->exhausted;
+        t.rule = token.rule;
+        t.length = token.length;
+        if (t.lookahead > relex->max_lookahead)
+        {
+            relex->max_lookahead = t.lookahead;
+        }
+        relex_push(relex, &t);
+        ++fresh;
+        if (token.rule)
+        {
+            run_action(scanner, scanner->rules.data[token.rule - 1].action);
+        }
+    }
+    *replaced += relex->count - relex->gap;
+    relex->count = relex->gap;
+    relex->condition = scanner->condition;
+    return fresh;
+}
+
+#define TOKEN_RING_SIZE 0x4000
+#define TOKEN_BATCH 0x100
+#define INPUT_CHUNK 0x100000
+
+// single-producer/single-consumer queue of tokens. each side owns one
+// index and only publishes it every TOKEN_BATCH tokens, so the cache lines
+// holding head and tail change hands once per batch instead of per token
+typedef struct
+{
+    token_t *tokens;
+    size_t mask;
+    alignas(64) atomic_size_t head;
+    alignas(64) atomic_size_t tail;
+    alignas(64) atomic_bool done;
+} token_ring_t;
+
+typedef struct
+{
+    FILE *fp;
+    char *buffer;
+    size_t size;
+    atomic_size_t available;
+    atomic_bool eof;
+    // signalled whenever available grows or eof is set
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+} input_stage_t;
+
+typedef struct
+{
+    scanner_t *scanner;
+    input_stage_t input;
+    token_ring_t ring;
+    // producer-side copies of the indices
+    size_t head;
+    size_t tail;
+} pipeline_t;
+
+static void token_ring_init(token_ring_t *ring, size_t size)
+{
+    ring->tokens = malloc(sizeof(token_t) * size);
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->done, false);
+}
+
+static void token_ring_put(pipeline_t *pipeline, const token_t *token)
+{
+    token_ring_t *ring = &pipeline->ring;
+    while (pipeline->head - pipeline->tail > ring->mask)
+    {
+        // full as far as we know; hand over what we have and look again
+        atomic_store_explicit(&ring->head, pipeline->head, memory_order_release);
+        pipeline->tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (pipeline->head - pipeline->tail > ring->mask)
+        {
+            sched_yield();
+        }
+    }
+    ring->tokens[pipeline->head & ring->mask] = *token;
+    if ((++pipeline->head & (TOKEN_BATCH - 1)) == 0)
+    {
+        atomic_store_explicit(&ring->head, pipeline->head, memory_order_release);
+    }
+}
+
+static size_t token_ring_take(token_ring_t *ring, token_t *out, size_t max)
+{
+    // copies out up to max tokens, waiting for at least one; 0 means the
+    // producer has finished and everything has been taken
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head;
+    while ((head = atomic_load_explicit(&ring->head, memory_order_acquire)) == tail)
+    {
+        if (atomic_load_explicit(&ring->done, memory_order_acquire))
+        {
+            head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (head == tail)
+            {
+                return 0;
+            }
+            break;
+        }
+        sched_yield();
+    }
+    size_t count = head - tail < max ? head - tail : max;
+    for (size_t i = 0; i < count; ++i)
+    {
+        out[i] = ring->tokens[(tail + i) & ring->mask];
+    }
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+static void *input_thread(void *arg)
+{
+    input_stage_t *input = arg;
+    size_t length = 0;
+    size_t n;
+    while (length < input->size &&
+           (n = fread(input->buffer + length, 1,
+                      input->size - length < INPUT_CHUNK ? input->size - length : INPUT_CHUNK, input->fp)) > 0)
+    {
+        length += n;
+        pthread_mutex_lock(&input->lock);
+        atomic_store_explicit(&input->available, length, memory_order_release);
+        pthread_cond_broadcast(&input->more);
+        pthread_mutex_unlock(&input->lock);
+    }
+    pthread_mutex_lock(&input->lock);
+    atomic_store_explicit(&input->eof, true, memory_order_release);
+    pthread_cond_broadcast(&input->more);
+    pthread_mutex_unlock(&input->lock);
+    return NULL;
+}
+
+static void input_wait(input_stage_t *input, size_t wanted)
+{
+    // sleeps until wanted bytes have been read or the input has ended
+    pthread_mutex_lock(&input->lock);
+    while (atomic_load_explicit(&input->available, memory_order_acquire) < wanted &&
+           !atomic_load_explicit(&input->eof, memory_order_acquire))
+    {
+        pthread_cond_wait(&input->more, &input->lock);
+    }
+    pthread_mutex_unlock(&input->lock);
+}
+
+static void *scanner_thread(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    scanner_t *scanner = pipeline->scanner;
+    input_stage_t *input = &pipeline->input;
+    size_t pos = 0;
+    for (;;)
+    {
+        // eof is read first: once it is set, available is final
+        bool eof = atomic_load_explicit(&input->eof, memory_order_acquire);
+        size_t available = atomic_load_explicit(&input->available, memory_order_acquire);
+        size_t start = pos;
+        token_t token;
+        if (!scan(scanner, input->buffer, available, &pos, &token))
+        {
+            if (eof)
+            {
+                break;
+            }
+            input_wait(input, pos + 1);
+            continue;
+        }
+        if (scanner->exhausted && !eof)
+        {
+            // the token may go on past what has been read so far. it is
+            // scanned again once what was read past its start has doubled,
+            // so however many chunks it spans it is scanned about twice
+            pos = start;
+            input_wait(input, available + (available - start));
+            continue;
+        }
+        token_ring_put(pipeline, &token);
+        if (token.rule)
+        {
+            run_action(scanner, scanner->rules.data[token.rule - 1].action);
+        }
+    }
+    atomic_store_explicit(&pipeline->ring.head, pipeline->head, memory_order_release);
+    atomic_store_explicit(&pipeline->ring.done, true, memory_order_release);
+    return NULL;
+}
+
+static void scan_pipelined(scanner_t *scanner, FILE *fp, FILE *out)
+{
+    // reading, scanning and consuming run on three threads. a file whose
+    // size is known is scanned while it is still being read; anything else
+    // is read up front and only scanning and consuming overlap
+    pipeline_t pipeline;
+    pipeline.scanner = scanner;
+    pipeline.head = 0;
+    pipeline.tail = 0;
+    token_ring_init(&pipeline.ring, TOKEN_RING_SIZE);
+
+    struct stat st;
+    bool streaming = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+    pipeline.input.fp = fp;
+    atomic_init(&pipeline.input.available, 0);
+    atomic_init(&pipeline.input.eof, false);
+    pthread_mutex_init(&pipeline.input.lock, NULL);
+    pthread_cond_init(&pipeline.input.more, NULL);
+    pthread_t reader;
+    if (streaming)
+    {
+        pipeline.input.size = st.st_size;
+        pipeline.input.buffer = malloc(st.st_size + 1);
+        pthread_create(&reader, NULL, input_thread, &pipeline.input);
+    }
+    else
+    {
+        pipeline.input.buffer = read_file(fp, &pipeline.input.size);
+        scanner_use_sentinel(scanner);
+        atomic_store(&pipeline.input.available, pipeline.input.size);
+        atomic_store(&pipeline.input.eof, true);
+    }
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, scanner_thread, &pipeline);
+    token_t *batch = malloc(sizeof(token_t) * TOKEN_BATCH);
+    size_t count;
+    while ((count = token_ring_take(&pipeline.ring, batch, TOKEN_BATCH)) > 0)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            print_token(out, pipeline.input.buffer, &batch[i]);
+        }
+    }
+    pthread_join(producer, NULL);
+    if (streaming)
+    {
+        pthread_join(reader, NULL);
+    }
+    free(batch);
+    free(pipeline.ring.tokens);
+    free(pipeline.input.buffer);
+    pthread_cond_destroy(&pipeline.input.more);
+    pthread_mutex_destroy(&pipeline.input.lock);
+}
+
+#define STREAM_HEADROOM 0x10000
+#define URING_DEPTH 4
+
+typedef void (*token_sink_t)(const token_t *token, const char *text, void *arg);
+
+// tokenizes input that arrives as a sequence of buffers. every buffer has
+// STREAM_HEADROOM writable bytes in front of it; a token cut off at the end
+// of one buffer is copied there, in front of the next, so the scanner always
+// sees it in one piece. only longer tokens need a separate merged copy
+typedef struct
+{
+    scanner_t *scanner;
+    token_sink_t sink;
+    void *arg;
+    // file offset of the first byte not yet tokenized
+    size_t base;
+    char *carry;
+    size_t carry_length;
+    size_t carry_capacity;
+} stream_t;
+
+static void stream_init(stream_t *stream, scanner_t *scanner, token_sink_t sink, void *arg)
+{
+    stream->scanner = scanner;
+    stream->sink = sink;
+    stream->arg = arg;
+    stream->base = 0;
+    stream->carry = NULL;
+    stream->carry_length = 0;
+    stream->carry_capacity = 0;
+}
+
+static void stream_feed(stream_t *stream, char *data, size_t length, bool eof)
+{
+    char *input = data;
+    char *merged = NULL;
+    size_t n = stream->carry_length + length;
+    if (stream->carry_length > 0)
+    {
+        if (data && stream->carry_length <= STREAM_HEADROOM)
+        {
+            input = data - stream->carry_length;
+        }
+        else
+        {
+            input = merged = malloc(n);
+        }
+        memcpy(input, stream->carry, stream->carry_length);
+        if (merged && length > 0)
+        {
+            memcpy(merged + stream->carry_length, data, length);
+        }
+    }
+
+    size_t pos = 0;
+    token_t token;
+    while (pos < n)
+    {
+        size_t start = pos;
+        scan(stream->scanner, input, n, &pos, &token);
+        if (stream->scanner->exhausted && !eof)
+        {
+            pos = start;
+            break;
+        }
+        const char *text = input + token.start;
+        token.start += stream->base;
+        stream->sink(&token, text, stream->arg);
+        if (token.rule)
+        {
+            run_action(stream->scanner, stream->scanner->rules.data[token.rule - 1].action);
+        }
+    }
+
+    // the buffer is about to be reused, so whatever is left is kept aside
+    if (pos > 0)
+    {
+        stream->scanner->bol = input[pos - 1] == '\n';
+    }
+    stream->base += pos;
+    stream->carry_length = n - pos;
+    if (stream->carry_length > stream->carry_capacity)
+    {
+        stream->carry_capacity = stream->carry_length;
+        stream->carry = realloc(stream->carry, stream->carry_capacity);
+    }
+    if (stream->carry_length > 0)
+    {
+        memmove(stream->carry, input + pos, stream->carry_length);
+    }
+    free(merged);
+}
+
+static void scan_chunked(scanner_t *scanner, FILE *fp, token_sink_t sink, void *arg)
+{
+    stream_t stream;
+    stream_init(&stream, scanner, sink, arg);
+    char *buffer = malloc(STREAM_HEADROOM + INPUT_CHUNK);
+    size_t n;
+    while ((n = fread(buffer + STREAM_HEADROOM, 1, INPUT_CHUNK, fp)) > 0)
+    {
+        stream_feed(&stream, buffer + STREAM_HEADROOM, n, false);
+    }
+    stream_feed(&stream, NULL, 0, true);
+    free(stream.carry);
+    free(buffer);
+}
+
+#ifdef HAVE_IO_URING
+typedef struct
+{
+    int fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned queued;
+} uring_t;
+
+static bool uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd,
+                               IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        return false;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->queued = 0;
+    return true;
+}
+
+static void uring_free(uring_t *ring)
+{
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static void uring_queue_read(uring_t *ring, int fd, char *buffer, unsigned length, size_t offset, unsigned tag)
+{
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    ++ring->queued;
+}
+
+static int uring_submit_and_wait(uring_t *ring, unsigned *tag)
+{
+    // hands every queued read to the kernel, then takes one completion and
+    // returns its result
+    if (ring->queued > 0)
+    {
+        atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, *ring->sq_tail + ring->queued,
+                              memory_order_release);
+    }
+    unsigned head = *ring->cq_head;
+    unsigned submit = ring->queued;
+    ring->queued = 0;
+    while (head == atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire) || submit > 0)
+    {
+        if (syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        submit = 0;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    int res = cqe->res;
+    *tag = cqe->user_data;
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head + 1, memory_order_release);
+    return res;
+}
+
+typedef struct
+{
+    char *memory;
+    size_t offset;
+    size_t length;
+    size_t filled;
+} uring_buffer_t;
+
+static bool scan_uring(scanner_t *scanner, int fd, size_t size, token_sink_t sink, void *arg)
+{
+    // URING_DEPTH reads of INPUT_CHUNK bytes are kept in flight. they may
+    // complete in any order, but buffers are handed to the scanner strictly
+    // by file offset, and each is refilled as soon as it has been scanned
+    uring_t ring;
+    if (!uring_init(&ring, URING_DEPTH))
+    {
+        return false;
+    }
+    stream_t stream;
+    stream_init(&stream, scanner, sink, arg);
+    uring_buffer_t buffers[URING_DEPTH];
+    size_t next = 0;
+    for (int i = 0; i < URING_DEPTH; ++i)
+    {
+        buffers[i].memory = malloc(STREAM_HEADROOM + INPUT_CHUNK);
+        buffers[i].length = 0;
+        if (next < size)
+        {
+            buffers[i].offset = next;
+            buffers[i].length = size - next < INPUT_CHUNK ? size - next : INPUT_CHUNK;
+            buffers[i].filled = 0;
+            uring_queue_read(&ring, fd, buffers[i].memory + STREAM_HEADROOM, buffers[i].length, next, i);
+            next += buffers[i].length;
+        }
+    }
+
+    size_t expected = 0;
+    while (expected < size)
+    {
+        int ready = -1;
+        for (int i = 0; i < URING_DEPTH; ++i)
+        {
+            if (buffers[i].length > 0 && buffers[i].offset == expected && buffers[i].filled == buffers[i].length)
+            {
+                ready = i;
+            }
+        }
+        if (ready < 0)
+        {
+            unsigned tag;
+            int res = uring_submit_and_wait(&ring, &tag);
+            uring_buffer_t *b = &buffers[tag];
+            if (res < 0)
+            {
+                fprintf(stderr, "read: %s\n", strerror(-res));
+                exit(1);
+            }
+            if (res == 0)
+            {
+                // the file shrank underneath us
+                b->length = b->filled;
+                size = b->offset + b->length;
+                continue;
+            }
+            b->filled += res;
+            if (b->filled < b->length)
+            {
+                uring_queue_read(&ring, fd, b->memory + STREAM_HEADROOM + b->filled, b->length - b->filled,
+                                 b->offset + b->filled, tag);
+            }
+            continue;
+        }
+
+        uring_buffer_t *b = &buffers[ready];
+        expected += b->length;
+        stream_feed(&stream, b->memory + STREAM_HEADROOM, b->length, expected >= size);
+        b->length = 0;
+        if (next < size)
+        {
+            b->offset = next;
+            b->length = size - next < INPUT_CHUNK ? size - next : INPUT_CHUNK;
+            b->filled = 0;
+            uring_queue_read(&ring, fd, b->memory + STREAM_HEADROOM, b->length, next, ready);
+            next += b->length;
+        }
+    }
+    if (size == 0 || stream.carry_length > 0)
+    {
+        stream_feed(&stream, NULL, 0, true);
+    }
+
+    // reads cut short by a shrinking file may still be in flight
+    for (int i = 0; i < URING_DEPTH; ++i)
+    {
+        while (buffers[i].length > 0 && buffers[i].filled < buffers[i].length)
+        {
+            unsigned tag;
+            int res = uring_submit_and_wait(&ring, &tag);
+            uring_buffer_t *b = &buffers[tag];
+            b->filled = res > 0 ? b->filled + res : b->length;
+        }
+    }
+    for (int i = 0; i < URING_DEPTH; ++i)
+    {
+        free(buffers[i].memory);
+    }
+    free(stream.carry);
+    uring_free(&ring);
+    return true;
+}
+#endif
+
+static void scan_async(scanner_t *scanner, FILE *fp, token_sink_t sink, void *arg)
+{
+    // io_uring keeps several reads in flight so slow storage never stalls
+    // the scan loop; without it, or for pipes, the same chunked scan runs on
+    // blocking reads
+#ifdef HAVE_IO_URING
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && scan_uring(scanner, fileno(fp), st.st_size, sink, arg))
+    {
+        return;
+    }
+#endif
+    scan_chunked(scanner, fp, sink, arg);
+}
+
+static void print_token_sink(const token_t *token, const char *text, void *arg)
+{
+    print_token_text(arg, token, text);
+}
+
+static int usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [scan [-i] [-f] [-p | -u | -b] [-l] RULES [INPUT] | table [-i] [-f] RULES OUTPUT | "
+            "relex [-i] [-f] RULES OLD NEW | filter [-i] [-f] [-x] [-k N] EXPR... | extract [-i] [-f] PATTERN | "
+            "replace [-i] [-f] PATTERN TEMPLATE [INPUT] | index INDEX PATH... | "
+            "search [-i] [-f] [-q] [-n] INDEX PATTERN]\n",
+            program);
+    return 2;
+}
+
+static int scan_main(int argc, char *argv[])
+{
+    int flags = 0;
+    bool pipelined = false;
+    bool async = false;
+    bool batched = false;
+    bool numbered = false;
+    bool force = false;
+    int arg = 2;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg)
+    {
+        if (strcmp(argv[arg], "-i") == 0)
+        {
+            flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[arg], "-f") == 0)
+        {
+            force = true;
+        }
+        else if (strcmp(argv[arg], "-p") == 0)
+        {
+            pipelined = true;
+        }
+        else if (strcmp(argv[arg], "-u") == 0)
+        {
+            async = true;
+        }
+        else if (strcmp(argv[arg], "-b") == 0)
+        {
+            batched = true;
+        }
+        else if (strcmp(argv[arg], "-l") == 0)
+        {
+            numbered = true;
+        }
+        else
+        {
+            return usage(argv[0]);
+        }
+    }
+    if (arg >= argc || (numbered && (pipelined || async)))
+    {
+        return usage(argv[0]);
+    }
+    FILE *fp = fopen(argv[arg], "r");
+    if (!fp)
+    {
+        perror(argv[arg]);
+        return 1;
+    }
+    size_t length;
+    char *rules = read_file(fp, &length);
+    fclose(fp);
+    ++arg;
+
+    nfa_t *nfa = thompson(rules, flags);
+    nfa_line_starts(nfa);
+    keyword_table_t *keywords = extract_keywords(nfa);
+    vec_dfa_t shards;
+    vec_init(&shards);
+    compile_shards(nfa, force, &shards);
+    scanner_t *scanner = make_scanner(nfa, shards.data, shards.length);
+    scanner->keywords = keywords;
+
+    fp = arg < argc ? fopen(argv[arg], "rb") : stdin;
+    if (!fp)
+    {
+        perror(argv[arg]);
+        return 1;
+    }
+    if (pipelined)
+    {
+        scan_pipelined(scanner, fp, stdout);
+    }
+    else if (async)
+    {
+        scan_async(scanner, fp, print_token_sink, stdout);
+    }
+    else if (batched)
+    {
+        char *input = read_file(fp, &length);
+        line_index_t index;
+        line_index_t *lines = numbered ? &index : NULL;
+        if (lines)
+        {
+            line_index_init(lines, input, length);
+        }
+        scanner_use_sentinel(scanner);
+        token_columns_t columns;
+        token_columns_init(&columns, scanner, COLUMNS_BATCH);
+        size_t pos = 0;
+        while (scan_columns(scanner, input, length, &pos, &columns) > 0)
+        {
+            for (size_t i = 0; i < columns.count; ++i)
+            {
+                token_t token = {columns.kind[i], columns.base + columns.start[i], columns.length[i]};
+                print_token_at(stdout, input, &token, lines);
+            }
+        }
+        token_columns_free(&columns);
+        if (lines)
+        {
+            line_index_free(lines);
+        }
+        free(input);
+    }
+    else
+    {
+        // -l gives positions as line:column, which only the printing asks
+        // the newline index for; the scan itself still counts bytes
+        char *input = read_file(fp, &length);
+        line_index_t index;
+        line_index_t *lines = numbered ? &index : NULL;
+        if (lines)
+        {
+            line_index_init(lines, input, length);
+        }
+        scanner_use_sentinel(scanner);
+        size_t pos = 0;
+        token_t token;
+        while (scan(scanner, input, length, &pos, &token))
+        {
+            print_token_at(stdout, input, &token, lines);
+            if (token.rule)
+            {
+                run_action(scanner, scanner->rules.data[token.rule - 1].action);
+            }
+        }
+        if (lines)
+        {
+            line_index_free(lines);
+        }
+        free(input);
+    }
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+
+    scanner_free(scanner);
+    for (int g = 0; g < shards.length; ++g)
+    {
+        dfa_free(shards.data[g]);
+    }
+    vec_deinit(&shards);
+    nfa_free(nfa);
+    free(rules);
+    return 0;
+}
+
+static int table_main(int argc, char *argv[])
+{
+    // writes the unminimized machine for RULES to OUTPUT, a row at a time
+    int flags = 0;
+    bool force = false;
+    int arg = 2;
+    for (; arg < argc; ++arg)
+    {
+        if (strcmp(argv[arg], "-i") == 0)
+        {
+            flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[arg], "-f") == 0)
+        {
+            force = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (arg + 2 != argc)
+    {
+        return usage(argv[0]);
+    }
+    FILE *fp = fopen(argv[arg], "r");
+    if (!fp)
+    {
+        perror(argv[arg]);
+        return 1;
+    }
+    size_t length;
+    char *rules = read_file(fp, &length);
+    fclose(fp);
+
+    nfa_t *nfa = thompson(rules, flags);
+    for (int i = 0; i < nfa->rules.length; ++i)
+    {
+        if (nfa->rules.data[i].trail == TRAIL_VARIABLE)
+        {
+            fprintf(stderr, "table files have no room for variable trailing context\n");
+            exit(1);
+        }
+    }
+    nfa_line_starts(nfa);
+    nfa_check_cost(nfa, force);
+    FILE *out = fopen(argv[arg + 1], "wb");
+    if (!out)
+    {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+    int states = nfa_to_table(nfa, &table_default_limits, out);
+    if (ferror(out) || fclose(out) != 0)
+    {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+    if (states < 0)
+    {
+        fprintf(stderr, "DFA grew past %zu bytes of state sets\n", table_default_limits.max_bytes);
+        return 1;
+    }
+    nfa_free(nfa);
+    free(rules);
+    return 0;
+}
+
+static int relex_main(int argc, char *argv[])
+{
+    // lexes OLD, then brings the tokens up to date with NEW as if NEW were
+    // OLD after one edit, and prints the tokens that changed
+    int flags = 0;
+    bool force = false;
+    int arg = 2;
+    for (; arg < argc; ++arg)
+    {
+        if (strcmp(argv[arg], "-i") == 0)
+        {
+            flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[arg], "-f") == 0)
+        {
+            force = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (arg + 3 != argc)
+    {
+        return usage(argv[0]);
+    }
+    char *text[3];
+    size_t length[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        FILE *fp = fopen(argv[arg + i], "rb");
+        if (!fp)
+        {
+            perror(argv[arg + i]);
+            return 1;
+        }
+        text[i] = read_file(fp, &length[i]);
+        fclose(fp);
+    }
+
+    nfa_t *nfa = thompson(text[0], flags);
+    nfa_line_starts(nfa);
+    keyword_table_t *keywords = extract_keywords(nfa);
+    vec_dfa_t shards;
+    vec_init(&shards);
+    compile_shards(nfa, force, &shards);
+    scanner_t *scanner = make_scanner(nfa, shards.data, shards.length);
+    scanner->keywords = keywords;
+
+    relex_t relex;
+    relex_init(&relex, scanner);
+    size_t first;
+    size_t replaced;
+    relex_edit(&relex, text[1], length[1], 0, length[1], &first, &replaced);
+
+    // the edit is whatever lies between the common prefix and suffix
+    size_t prefix = 0;
+    while (prefix < length[1] && prefix < length[2] && text[1][prefix] == text[2][prefix])
+    {
+        ++prefix;
+    }
+    size_t suffix = 0;
+    while (suffix < length[1] - prefix && suffix < length[2] - prefix &&
+           text[1][length[1] - suffix - 1] == text[2][length[2] - suffix - 1])
+    {
+        ++suffix;
+    }
+    size_t fresh = relex_edit(&relex, text[2], length[2], prefix, length[2] - prefix - suffix, &first, &replaced);
+    printf("@@ -%zu,%zu +%zu,%zu @@\n", first, replaced, first, fresh);
+    for (size_t i = first; i < first + fresh; ++i)
+    {
+        token_t token;
+        relex_token(&relex, i, &token);
+        print_token(stdout, text[2], &token);
+    }
+
+    relex_free(&relex);
+    scanner_free(scanner);
+    for (int g = 0; g < shards.length; ++g)
+    {
+        dfa_free(shards.data[g]);
+    }
+    vec_deinit(&shards);
+    nfa_free(nfa);
+    for (int i = 0; i < 3; ++i)
+    {
+        free(text[i]);
+    }
+    return 0;
+}
+
+typedef struct
+{
+    int argc;
+    char **argv;
+    int arg;
+    int flags;
+    // match whole lines instead of searching them
+    bool whole;
+    // compile patterns the estimate would turn away
+    bool force;
+} filter_parser_t;
+
+static const char *filter_peek(const filter_parser_t *p)
+{
+    return p->arg < p->argc ? p->argv[p->arg] : "";
+}
+
+static dfa_t *filter_combine(dfa_t *a, dfa_t *b, int op)
+{
+    // minimizing after every operation keeps the next product small
+    dfa_t *product = dfa_product(a, b, op);
+    dfa_t *min = minimize_dfa(product);
+    dfa_free(product);
+    dfa_free(a);
+    dfa_free(b);
+    return min;
+}
+
+static dfa_t *filter_or(filter_parser_t *p);
+
+static dfa_t *filter_words(const char *path, int flags, bool whole)
+{
+    // one word per line of the file
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        perror(path);
+        exit(1);
+    }
+    size_t length;
+    char *text = read_file(fp, &length);
+    fclose(fp);
+    vec_str_t words;
+    vec_init(&words);
+    for (char *line = text; line < text + length;)
+    {
+        char *end = memchr(line, '\n', text + length - line);
+        end = end ? end : text + length;
+        size_t n = end - line;
+        if (n > 0 && line[n - 1] == '\r')
+        {
+            --n;
+        }
+        if (n > 0)
+        {
+            vec_push(&words, copy_string(line, n));
+        }
+        line = end + 1;
+    }
+    free(text);
+    dfa_t *dfa = whole ? dfa_from_words(&words, flags) : dfa_search_words(&words, flags);
+    for (int i = 0; i < words.length; ++i)
+    {
+        free(words.data[i]);
+    }
+    vec_deinit(&words);
+    return dfa;
+}
+
+static dfa_t *filter_pattern(filter_parser_t *p)
+{
+    // pattern | "@" file | "not" pattern | "(" or ")"
+    if (p->arg >= p->argc)
+    {
+        fprintf(stderr, "Expected a pattern\n");
+        exit(1);
+    }
+    const char *word = p->argv[p->arg++];
+    if (strcmp(word, "not") == 0)
+    {
+        // the complement of a minimal machine is minimal already, apart
+        // from at most one state that accepts everything and the sink
+        dfa_t *a = filter_pattern(p);
+        dfa_t *complement = dfa_complement(a);
+        dfa_free(a);
+        return complement;
+    }
+    if (strcmp(word, "(") == 0)
+    {
+        dfa_t *a = filter_or(p);
+        if (strcmp(filter_peek(p), ")") != 0)
+        {
+            fprintf(stderr, "Expected )\n");
+            exit(1);
+        }
+        ++p->arg;
+        return a;
+    }
+    // word lists and alternations of literals go straight to a minimal
+    // automaton when matching whole lines, or to an aho-corasick one when
+    // searching, without thompson or subset construction
+    if (word[0] == '@')
+    {
+        return filter_words(word + 1, p->flags, p->whole);
+    }
+    vec_str_t words;
+    vec_init(&words);
+    if (literal_alternation(word, &words))
+    {
+        dfa_t *dfa = p->whole ? dfa_from_words(&words, p->flags) : dfa_search_words(&words, p->flags);
+        for (int i = 0; i < words.length; ++i)
+        {
+            free(words.data[i]);
+        }
+        vec_deinit(&words);
+        return dfa;
+    }
+    vec_deinit(&words);
+    nfa_t *nfa = thompson(word, p->flags);
+    if (!p->whole)
+    {
+        nfa_search(nfa);
+    }
+    dfa_t *dfa = compile_dfa(nfa, p->force);
+    dfa_t *min = minimize_dfa(dfa);
+    dfa_free(dfa);
+    nfa_free(nfa);
+    return min;
+}
+
+static dfa_t *filter_and(filter_parser_t *p)
+{
+    // "and not" is a difference, which saves building the complement
+    dfa_t *a = filter_pattern(p);
+    while (strcmp(filter_peek(p), "and") == 0)
+    {
+        ++p->arg;
+        int op = PRODUCT_INTERSECTION;
+        if (strcmp(filter_peek(p), "not") == 0)
+        {
+            ++p->arg;
+            op = PRODUCT_DIFFERENCE;
+        }
+        a = filter_combine(a, filter_pattern(p), op);
+    }
+    return a;
+}
+
+static dfa_t *filter_or(filter_parser_t *p)
+{
+    dfa_t *a = filter_and(p);
+    while (strcmp(filter_peek(p), "or") == 0)
+    {
+        ++p->arg;
+        a = filter_combine(a, filter_and(p), PRODUCT_UNION);
+    }
+    return a;
+}
+
+static bool filter_line(const dfa_t *dfa, const sheng_t *sheng, const char *line, size_t length, bool whole)
+{
+    // when searching, the line runs between two newlines so ^ and $ can
+    // match at its ends
+    if (sheng)
+    {
+        int state = whole ? 0 : sheng_run(sheng, 0, "\n", 1);
+        state = sheng_run(sheng, state, line, length);
+        state = whole ? state : sheng_run(sheng, state, "\n", 1);
+        return sheng->accept[state];
+    }
+    dfa_node_t *state = whole ? dfa->data[0] : do_goto(dfa->data[0], '\n');
+    for (size_t i = 0; i < length && state; ++i)
+    {
+        unsigned char c = line[i];
+        state = do_goto(state, c && c < BYTE_OTHER ? c : BYTE_OTHER);
+    }
+    if (state && !whole)
+    {
+        state = do_goto(state, '\n');
+    }
+    return state && state->accept;
+}
+
+// patterns with no branches or closures, seen in the NFA right after
+// thompson, are matched without building an automaton: a literal with a
+// vectorized search or memcmp at an anchor, and a single class with one
+// pass over a byte set
+#define SIMPLE_LITERAL 1
+#define SIMPLE_CLASS 2
+
+typedef struct
+{
+    int kind;
+    int anchor;
+    char *literal;
+    size_t length;
+    // the class members, as a string for strcspn and as a byte map
+    char members[0x80];
+    bool in_class[0x100];
+} simple_pattern_t;
+
+static bool simple_pattern(const nfa_t *nfa, bool whole, simple_pattern_t *simple)
+{
+    if (nfa->rules.length != 1 || nfa->starts.length != 1 || nfa->rules.data[0].junction)
+    {
+        return false;
+    }
+    vec_nfa_node_t nodes;
+    vec_init(&nodes);
+    nfa_node_t *p = nfa->nfa.data[nfa->start];
+    for (; p && !p->accept && !p->next[1]; p = p->next[0])
+    {
+        if (p->edge != EDGE_EPSILON && p->edge != EDGE_EMPTY)
+        {
+            vec_push(&nodes, p);
+        }
+    }
+    // the anchors are the '\n' in front and the [\n\r] at the end
+    int anchor = nfa->rules.data[0].anchor;
+    int first = (anchor & ANCHOR_BOL) ? 1 : 0;
+    int last = nodes.length - ((anchor & ANCHOR_EOL) ? 1 : 0);
+    bool simple_shape = p && p->accept && !p->next[0] && !p->next[1] && last > first && !(whole && anchor);
+    simple->kind = 0;
+    simple->anchor = anchor;
+    if (simple_shape && last - first == 1 && nodes.data[first]->edge == EDGE_CHARACTER_CLASS)
+    {
+        const nfa_node_t *q = nodes.data[first];
+        int n = 0;
+        memset(simple->in_class, 0, sizeof(simple->in_class));
+        for (int c = 1; c < 0x7F; ++c)
+        {
+            if (q->complement != bitset_get(q->bitset, c))
+            {
+                simple->in_class[c] = true;
+                simple->members[n++] = c;
+            }
+        }
+        simple->members[n] = '\0';
+        simple->kind = SIMPLE_CLASS;
+    }
+    else if (simple_shape)
+    {
+        int i = first;
+        while (i < last && nodes.data[i]->edge > 0)
+        {
+            ++i;
+        }
+        if (i == last)
+        {
+            simple->kind = SIMPLE_LITERAL;
+            simple->length = last - first;
+            simple->literal = malloc(simple->length);
+            for (i = first; i < last; ++i)
+            {
+                simple->literal[i - first] = nodes.data[i]->edge;
+            }
+        }
+    }
+    vec_deinit(&nodes);
+    return simple->kind != 0;
+}
+
+static void simple_pattern_free(simple_pattern_t *simple)
+{
+    if (simple->kind == SIMPLE_LITERAL)
+    {
+        free(simple->literal);
+    }
+}
+
+static const char *literal_find(const simple_pattern_t *simple, const char *text, size_t length)
+{
+    // candidates are where the first and the last byte of the literal both
+    // match, sixteen at a time (Mula), and memcmp confirms them. unlike
+    // memmem this has no setup to repeat for every line
+    const char *literal = simple->literal;
+    size_t m = simple->length;
+    size_t i = 0;
+    if (m > length)
+    {
+        return NULL;
+    }
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(literal[0]);
+    __m128i last = _mm_set1_epi8(literal[m - 1]);
+    for (; i + m - 1 + 16 <= length; i += 16)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(text + i)), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(text + i + m - 1)), last);
+        for (unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b)); mask; mask &= mask - 1)
+        {
+            size_t k = i + __builtin_ctz(mask);
+            if (memcmp(text + k, literal, m) == 0)
+            {
+                return text + k;
+            }
+        }
+    }
+#endif
+    for (; i + m <= length; ++i)
+    {
+        if (text[i] == literal[0] && memcmp(text + i, literal, m) == 0)
+        {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+static bool simple_at(const simple_pattern_t *simple, const char *line, size_t length, size_t i)
+{
+    // whether the pattern matches at i. $ matches before a '\r' as well as
+    // at the end of the line, like the [\n\r] thompson compiles it to
+    size_t end = i + (simple->kind == SIMPLE_LITERAL ? simple->length : 1);
+    if (end > length || ((simple->anchor & ANCHOR_BOL) && i != 0) ||
+        ((simple->anchor & ANCHOR_EOL) && end != length && line[end] != '\r'))
+    {
+        return false;
+    }
+    return simple->kind == SIMPLE_LITERAL ? memcmp(line + i, simple->literal, simple->length) == 0
+                                          : simple->in_class[(unsigned char)line[i]];
+}
+
+static bool simple_match(const simple_pattern_t *simple, const char *line, size_t length, bool whole)
+{
+    // line must be NUL-terminated after length, as getline leaves it
+    if (whole)
+    {
+        return length == (simple->kind == SIMPLE_LITERAL ? simple->length : 1) && simple_at(simple, line, length, 0);
+    }
+    if (simple->anchor & ANCHOR_BOL)
+    {
+        return simple_at(simple, line, length, 0);
+    }
+    if (simple->anchor & ANCHOR_EOL)
+    {
+        // only the end of the line and the '\r's can end a match
+        size_t m = simple->kind == SIMPLE_LITERAL ? simple->length : 1;
+        if (length >= m && simple_at(simple, line, length, length - m))
+        {
+            return true;
+        }
+        for (const char *cr = memchr(line, '\r', length); cr; cr = memchr(cr + 1, '\r', line + length - cr - 1))
+        {
+            if ((size_t)(cr - line) >= m && simple_at(simple, line, length, cr - line - m))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (simple->kind == SIMPLE_CLASS)
+    {
+        // strcspn also stops at a NUL inside the line
+        for (size_t i = strcspn(line, simple->members); i < length; i += 1 + strcspn(line + i + 1, simple->members))
+        {
+            if (line[i])
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    return literal_find(simple, line, length) != NULL;
+}
+
+static bool filter_simple(const filter_parser_t *p, simple_pattern_t *simple)
+{
+    // true if the whole expression is one pattern simple_pattern takes
+    const char *word = p->argv[p->arg];
+    if (p->arg + 1 != p->argc || strcmp(word, "not") == 0 || strcmp(word, "(") == 0 || word[0] == '@')
+    {
+        return false;
+    }
+    nfa_t *nfa = thompson(word, p->flags);
+    bool found = simple_pattern(nfa, p->whole, simple);
+    nfa_free(nfa);
+    return found;
+}
+
+#define APPROX_MAX_POSITIONS 64
+
+// matching with up to k edits (insertions, deletions and substitutions) by
+// Wu and Manber's bit-parallel simulation, run over the positions of the
+// pattern rather than its DFA so the cost per character is the same for
+// any k. bit 0 stands for nothing read yet and the other bits for the
+// consuming nodes of the NFA, which is what limits a pattern to 63 of them
+typedef struct
+{
+    int k;
+    // the positions that read each character
+    uint64_t chars[0x80];
+    // follow[j][b] is where the positions in byte j of a mask go next
+    uint64_t follow[APPROX_MAX_POSITIONS / 8][0x100];
+    // positions the pattern can end after
+    uint64_t last;
+    // the newlines ^ and $ read, which an edit may not remove or replace
+    uint64_t anchors;
+    // rows[d] holds the positions reached with d edits or fewer
+    uint64_t *rows;
+    uint64_t *next;
+} approx_t;
+
+static uint64_t approx_closure(const nfa_node_t *from, const int *position, int n, bool *accept)
+{
+    // the positions reachable from `from` over epsilon edges
+    uint64_t set = 0;
+    vec_nfa_node_t stack;
+    vec_init(&stack);
+    bool *seen = calloc(n, sizeof(bool));
+    vec_push(&stack, (nfa_node_t *)from);
+    seen[from->index] = true;
+    while (stack.length > 0)
+    {
+        const nfa_node_t *p = vec_pop(&stack);
+        *accept |= p->accept != 0;
+        if (nfa_consumes(p))
+        {
+            set |= (uint64_t)1 << position[p->index];
+            continue;
+        }
+        for (int j = 0; p->edge == EDGE_EPSILON && j <= 1; ++j)
+        {
+            if (p->next[j] && !seen[p->next[j]->index])
+            {
+                seen[p->next[j]->index] = true;
+                vec_push(&stack, p->next[j]);
+            }
+        }
+    }
+    free(seen);
+    vec_deinit(&stack);
+    return set;
+}
+
+static bool approx_init(approx_t *a, const nfa_t *nfa, int k)
+{
+    int n = nfa->nfa.length;
+    int *position = malloc(n * sizeof(int));
+    vec_nfa_node_t nodes;
+    vec_init(&nodes);
+    for (int i = 0; i < n; ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        position[i] = 0;
+        if (p && nfa_consumes(p))
+        {
+            position[i] = nodes.length + 1;
+            vec_push(&nodes, nfa->nfa.data[i]);
+        }
+    }
+    if (nodes.length >= APPROX_MAX_POSITIONS)
+    {
+        free(position);
+        vec_deinit(&nodes);
+        return false;
+    }
+
+    uint64_t follow[APPROX_MAX_POSITIONS] = {0};
+    bool accept = false;
+    memset(a, 0, sizeof(approx_t));
+    a->k = k;
+    follow[0] = approx_closure(nfa->nfa.data[nfa->start], position, n, &accept);
+    a->last = accept ? 1 : 0;
+    for (int i = 0; i < nodes.length; ++i)
+    {
+        const nfa_node_t *p = nodes.data[i];
+        uint64_t bit = (uint64_t)1 << (i + 1);
+        accept = false;
+        follow[i + 1] = approx_closure(p->next[0], position, n, &accept);
+        a->last |= accept ? bit : 0;
+        uint64_t chars[2];
+        nfa_node_chars(p, chars);
+        for (int c = 1; c < 0x80; ++c)
+        {
+            a->chars[c] |= (chars[c >> 6] >> (c & 63)) & 1 ? bit : 0;
+        }
+        bool newline = (chars[0] & ~(((uint64_t)1 << '\n') | ((uint64_t)1 << '\r'))) == 0 && chars[1] == 0;
+        a->anchors |= newline ? bit : 0;
+    }
+    for (int j = 0; j < APPROX_MAX_POSITIONS / 8; ++j)
+    {
+        for (int b = 0; b < 0x100; ++b)
+        {
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                a->follow[j][b] |= (b >> bit) & 1 ? follow[j * 8 + bit] : 0;
+            }
+        }
+    }
+    a->rows = malloc(sizeof(uint64_t) * (k + 1));
+    a->next = malloc(sizeof(uint64_t) * (k + 1));
+    free(position);
+    vec_deinit(&nodes);
+    return true;
+}
+
+static void approx_free(approx_t *a)
+{
+    free(a->rows);
+    free(a->next);
+}
+
+static uint64_t approx_follow(const approx_t *a, uint64_t set)
+{
+    uint64_t out = 0;
+    for (int j = 0; set; ++j, set >>= 8)
+    {
+        out |= a->follow[j][set & 0xFF];
+    }
+    return out;
+}
+
+static void approx_step(approx_t *a, unsigned char c, uint64_t start)
+{
+    // a position is reached with d edits by reading c from one reached with
+    // d, by skipping c (an insertion), by reading something else in c's
+    // place (a substitution), or by skipping the position itself (a
+    // deletion), the last three from d - 1 edits
+    uint64_t chars = c < 0x80 ? a->chars[c] : 0;
+    uint64_t *rows = a->rows;
+    uint64_t *next = a->next;
+    next[0] = (approx_follow(a, rows[0]) & chars) | start;
+    for (int d = 1; d <= a->k; ++d)
+    {
+        uint64_t edited = approx_follow(a, rows[d - 1]) | approx_follow(a, next[d - 1]);
+        next[d] = (approx_follow(a, rows[d]) & chars) | rows[d - 1] | (edited & ~a->anchors) | start;
+    }
+    a->next = rows;
+    a->rows = next;
+}
+
+static bool approx_line(approx_t *a, const char *line, size_t length, bool whole)
+{
+    // as with filter_line, a search sees the line between two newlines. a
+    // set is always contained in the one for the next d, so only the row
+    // for k edits has to be tested
+    uint64_t start = whole ? 0 : 1;
+    a->rows[0] = 1;
+    for (int d = 1; d <= a->k; ++d)
+    {
+        a->rows[d] = a->rows[d - 1] | (approx_follow(a, a->rows[d - 1]) & ~a->anchors);
+    }
+    if (!whole)
+    {
+        approx_step(a, '\n', start);
+    }
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (!whole && (a->rows[a->k] & a->last))
+        {
+            return true;
+        }
+        approx_step(a, line[i], start);
+    }
+    if (!whole && (a->rows[a->k] & a->last))
+    {
+        return true;
+    }
+    if (!whole)
+    {
+        approx_step(a, '\n', start);
+    }
+    return (a->rows[a->k] & a->last) != 0;
+}
+
+static int filter_approx(const filter_parser_t *p, int k)
+{
+    const char *word = p->argv[p->arg];
+    if (p->arg + 1 != p->argc || strcmp(word, "not") == 0 || strcmp(word, "(") == 0 || word[0] == '@')
+    {
+        fprintf(stderr, "-k takes a single pattern\n");
+        return 1;
+    }
+    nfa_t *nfa = thompson(word, p->flags);
+    approx_t a;
+    bool fits = approx_init(&a, nfa, k);
+    nfa_free(nfa);
+    if (!fits)
+    {
+        fprintf(stderr, "-k takes patterns of at most %d characters or classes\n", APPROX_MAX_POSITIONS - 1);
+        return 1;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, stdin)) >= 0)
+    {
+        size_t text = length > 0 && line[length - 1] == '\n' ? length - 1 : length;
+        if (approx_line(&a, line, text, p->whole))
+        {
+            fwrite(line, 1, length, stdout);
+        }
+    }
+    free(line);
+    approx_free(&a);
+    return 0;
+}
+
+static int filter_main(int argc, char *argv[])
+{
+    filter_parser_t p = {argc, argv, 2, REGEX_PATTERN, false, false};
+    int edits = 0;
+    for (; p.arg < argc; ++p.arg)
+    {
+        if (strcmp(argv[p.arg], "-i") == 0)
+        {
+            p.flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[p.arg], "-f") == 0)
+        {
+            p.force = true;
+        }
+        else if (strcmp(argv[p.arg], "-x") == 0)
+        {
+            p.whole = true;
+        }
+        else if (strcmp(argv[p.arg], "-k") == 0 && p.arg + 1 < argc)
+        {
+            char *end;
+            edits = strtol(argv[++p.arg], &end, 10);
+            if (*end || edits < 0)
+            {
+                return usage(argv[0]);
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (p.arg >= argc)
+    {
+        return usage(argv[0]);
+    }
+    if (edits > 0)
+    {
+        return filter_approx(&p, edits);
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    simple_pattern_t simple;
+    if (filter_simple(&p, &simple))
+    {
+        while ((length = getline(&line, &size, stdin)) >= 0)
+        {
+            size_t text = length > 0 && line[length - 1] == '\n' ? length - 1 : length;
+            if (simple_match(&simple, line, text, p.whole))
+            {
+                fwrite(line, 1, length, stdout);
+            }
+        }
+        free(line);
+        simple_pattern_free(&simple);
+        return 0;
+    }
+
+    dfa_t *dfa = filter_or(&p);
+    if (p.arg < argc)
+    {
+        fprintf(stderr, "Unexpected %s\n", argv[p.arg]);
+        exit(1);
+    }
+    sheng_t *sheng = make_sheng(dfa);
+    while ((length = getline(&line, &size, stdin)) >= 0)
+    {
+        size_t text = length > 0 && line[length - 1] == '\n' ? length - 1 : length;
+        if (filter_line(dfa, sheng, line, text, p.whole))
+        {
+            fwrite(line, 1, length, stdout);
+        }
+    }
+    free(line);
+    if (sheng)
+    {
+        sheng_free(sheng);
+    }
+    dfa_free(dfa);
+    return 0;
+}
+
+static int extract_main(int argc, char *argv[])
+{
+    // prints the groups of every line the pattern matches in full, tab
+    // separated, or the line itself when the pattern has no groups
+    int flags = REGEX_PATTERN;
+    bool force = false;
+    int arg = 2;
+    for (; arg < argc; ++arg)
+    {
+        if (strcmp(argv[arg], "-i") == 0)
+        {
+            flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[arg], "-f") == 0)
+        {
+            force = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (arg + 1 != argc)
+    {
+        return usage(argv[0]);
+    }
+    nfa_t *nfa = thompson(argv[arg], flags);
+    // the tagged DFA blows up wherever the plain one does
+    nfa_check_cost(nfa, force);
+    if (nfa->rules.length != 1 || nfa->rules.data[0].anchor != ANCHOR_NONE || nfa->rules.data[0].junction)
+    {
+        fprintf(stderr, "extract takes one pattern without anchors or trailing context\n");
+        exit(1);
+    }
+    // one-pass patterns need no per-thread registers; the rest go through
+    // the tagged DFA
+    onepass_t *onepass = nfa_to_onepass(nfa, &dfa_default_limits);
+    tdfa_t *tdfa = onepass ? NULL : nfa_to_tdfa(nfa, &dfa_default_limits);
+    if (!onepass && !tdfa)
+    {
+        fprintf(stderr, "DFA grew past %zu states or %zu bytes\n", dfa_default_limits.max_states,
+                dfa_default_limits.max_bytes);
+        exit(1);
+    }
+    int *buffer = malloc((tdfa ? 2 * tdfa->width * tdfa->tags + 1 : onepass->tags + 1) * sizeof(int));
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, stdin)) >= 0)
+    {
+        size_t text = length > 0 && line[length - 1] == '\n' ? length - 1 : length;
+        const int *regs = onepass ? (onepass_match(onepass, line, text, buffer) ? buffer : NULL)
+                                  : tdfa_match(tdfa, line, text, buffer);
+        if (!regs)
+        {
+            continue;
+        }
+        if (nfa->groups == 0)
+        {
+            fwrite(line, 1, length, stdout);
+            continue;
+        }
+        for (int g = 0; g < nfa->groups; ++g)
+        {
+            int start = regs[2 * g];
+            int end = regs[2 * g + 1];
+            if (g)
+            {
+                fputc('\t', stdout);
+            }
+            if (start >= 0 && end >= start)
+            {
+                fwrite(line + start, 1, end - start, stdout);
+            }
+        }
+        fputc('\n', stdout);
+    }
+    free(line);
+    free(buffer);
+    if (onepass)
+    {
+        onepass_free(onepass);
+    }
+    else
+    {
+        tdfa_free(tdfa);
+    }
+    nfa_free(nfa);
+    return 0;
+}
+
+// replace writes its output as a list of spans: runs of the input between
+// matches and the pieces of the template, pointing into the input and the
+// parsed template. nothing is copied; the list goes out with writev
+#define REPLACE_IOVECS 1024
+
+typedef struct
+{
+    // -1 for literal text, 0 for the whole match, or a group
+    int group;
+    const char *text;
+    size_t length;
+} template_part_t;
+
+typedef struct
+{
+    scanner_t *scanner;
+    // bytes a match can start with, or NULL when any can
+    const bool *first;
+    vec_t(template_part_t) parts;
+    char *literal;
+    // capture registers, when the template refers to a group
+    onepass_t *onepass;
+    tdfa_t *tdfa;
+    int *regs;
+    // a newline added behind the input so $ can match at its end, which is
+    // never written
+    size_t trail;
+    struct iovec iov[REPLACE_IOVECS];
+    int count;
+} replacer_t;
+
+static void template_parse(replacer_t *r, const char *template, int groups)
+{
+    // & or \0 is the match and \1 to \9 its groups; \n, \t, \& and \\ are
+    // the characters themselves
+    r->literal = malloc(strlen(template) + 1);
+    char *out = r->literal;
+    template_part_t part = {-1, out, 0};
+    vec_init(&r->parts);
+    for (const char *p = template; *p; ++p)
+    {
+        int group = -1;
+        char c = *p;
+        if (c == '&')
+        {
+            group = 0;
+        }
+        else if (c == '\\' && p[1])
+        {
+            c = *++p;
+            if (c >= '0' && c <= '9')
+            {
+                group = c - '0';
+            }
+            c = c == 'n' ? '\n' : c == 't' ? '\t' : c;
+        }
+        if (group < 0)
+        {
+            *out++ = c;
+            ++part.length;
+            continue;
+        }
+        if (group > groups)
+        {
+            fprintf(stderr, "the pattern has no group %d\n", group);
+            exit(1);
+        }
+        if (part.length)
+        {
+            vec_push(&r->parts, part);
+        }
+        template_part_t ref = {group, NULL, 0};
+        vec_push(&r->parts, ref);
+        part.text = out;
+        part.length = 0;
+    }
+    if (part.length)
+    {
+        vec_push(&r->parts, part);
+    }
+}
+
+static void replace_flush(replacer_t *r)
+{
+    // writev may take less than it was given, so go on from where it
+    // stopped
+    struct iovec *iov = r->iov;
+    int count = r->count;
+    while (count > 0)
+    {
+        ssize_t n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0)
+        {
+            perror("writev");
+            exit(1);
+        }
+        for (; count > 0 && (size_t)n >= iov->iov_len; ++iov, --count)
+        {
+            n -= iov->iov_len;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    r->count = 0;
+}
+
+static void replace_span(replacer_t *r, const char *text, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (r->count == REPLACE_IOVECS)
+    {
+        replace_flush(r);
+    }
+    r->iov[r->count].iov_base = (void *)text;
+    r->iov[r->count].iov_len = length;
+    ++r->count;
+}
+
+static void replace_match(replacer_t *r, const char *match, size_t length)
+{
+    const int *regs = NULL;
+    if (r->onepass)
+    {
+        regs = onepass_match(r->onepass, match, length, r->regs) ? r->regs : NULL;
+    }
+    else if (r->tdfa)
+    {
+        regs = tdfa_match(r->tdfa, match, length, r->regs);
+    }
+    for (int i = 0; i < r->parts.length; ++i)
+    {
+        const template_part_t *part = &r->parts.data[i];
+        if (part->group < 0)
+        {
+            replace_span(r, part->text, part->length);
+        }
+        else if (part->group == 0)
+        {
+            replace_span(r, match, length);
+        }
+        else if (regs && regs[2 * part->group - 2] >= 0 && regs[2 * part->group - 1] >= regs[2 * part->group - 2])
+        {
+            int start = regs[2 * part->group - 2];
+            replace_span(r, match + start, regs[2 * part->group - 1] - start);
+        }
+    }
+}
+
+static size_t replace_run(replacer_t *r, const char *input, size_t length, bool eof)
+{
+    // replaces every match in input and returns how much of it was
+    // written; without eof, a token that runs into the end is left for the
+    // next call, as is the text in front of it
+    size_t pos = 0;
+    size_t pending = 0;
+    size_t end = eof ? length - r->trail : length;
+    token_t token;
+    while (pos < length)
+    {
+        if (r->first && !r->first[(unsigned char)input[pos]])
+        {
+            ++pos;
+            continue;
+        }
+        size_t start = pos;
+        scan(r->scanner, input, length, &pos, &token);
+        if (r->scanner->exhausted && !eof)
+        {
+            pos = start;
+            break;
+        }
+        if (token.rule && token.start < end && token.start + token.length <= end)
+        {
+            replace_span(r, input + pending, token.start - pending);
+            replace_match(r, input + token.start, token.length);
+            pending = token.start + token.length;
+        }
+    }
+    if (pos > pending)
+    {
+        replace_span(r, input + pending, (pos < end ? pos : end) - pending);
+    }
+    replace_flush(r);
+    if (pos > 0)
+    {
+        // the next call's input starts at pos
+        r->scanner->bol = input[pos - 1] == '\n';
+    }
+    return pos;
 }
 
-typedef vec_t(vec_int_t) dtran_t;
-
-dtran_t make_dtran(const dfa_t *dfa)
+static int replace_main(int argc, char *argv[])
 {
-    dtran_t result;
-    vec_init(&result);
-    for (int i = 0; i < dfa->length; ++i)
+    // plainc replace [-i] [-f] PATTERN TEMPLATE [INPUT]: every
+    // non-overlapping longest match, scanning left to right, is replaced.
+    // a file is mapped so unchanged text goes from the page cache straight
+    // to writev; a pipe, or any input for a pattern anchored at the end of a
+    // line, is read in chunks
+    int flags = REGEX_PATTERN;
+    bool force = false;
+    int arg = 2;
+    for (; arg < argc; ++arg)
     {
-        vec_int_t dtran_row;
-        vec_init(&dtran_row);
+        if (strcmp(argv[arg], "-i") == 0)
+        {
+            flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[arg], "-f") == 0)
+        {
+            force = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (arg + 2 != argc && arg + 3 != argc)
+    {
+        return usage(argv[0]);
+    }
+    const char *pattern = argv[arg];
+    replacer_t r;
+    memset(&r, 0, sizeof(replacer_t));
+    nfa_t *captures = thompson(pattern, flags);
+    template_parse(&r, argv[arg + 1], captures->groups);
+    bool groups = false;
+    for (int i = 0; i < r.parts.length; ++i)
+    {
+        groups |= r.parts.data[i].group > 0;
+    }
+    if (groups)
+    {
+        // the groups are found by matching the token again, which needs
+        // the token to be the whole match
+        const rule_t *rule = &captures->rules.data[0];
+        if (captures->rules.length != 1 || rule->anchor != ANCHOR_NONE || rule->junction)
+        {
+            fprintf(stderr, "groups need one pattern without anchors or trailing context\n");
+            exit(1);
+        }
+        nfa_check_cost(captures, force);
+        r.onepass = nfa_to_onepass(captures, &dfa_default_limits);
+        r.tdfa = r.onepass ? NULL : nfa_to_tdfa(captures, &dfa_default_limits);
+        if (!r.onepass && !r.tdfa)
+        {
+            fprintf(stderr, "DFA grew past %zu states or %zu bytes\n", dfa_default_limits.max_states,
+                    dfa_default_limits.max_bytes);
+            exit(1);
+        }
+        r.regs = malloc((r.tdfa ? 2 * r.tdfa->width * r.tdfa->tags + 1 : r.onepass->tags + 1) * sizeof(int));
+    }
+
+    nfa_t *nfa = thompson(pattern, flags);
+    nfa_line_starts(nfa);
+    bool anchored = false;
+    for (int i = 0; i < nfa->rules.length; ++i)
+    {
+        anchored |= (nfa->rules.data[i].anchor & ANCHOR_EOL) != 0;
+    }
+    bool first[0x100] = {false};
+    if (nfa->rules.length == 1)
+    {
+        uint64_t chars[2];
+        rule_first_chars(&nfa->rules.data[0], chars);
         for (int c = 0; c < 0x80; ++c)
         {
-            vec_push(&dtran_row, -1);
+            first[c] = (chars[c >> 6] >> (c & 63)) & 1;
+        }
+        r.first = first;
+    }
+    keyword_table_t *keywords = extract_keywords(nfa);
+    vec_dfa_t shards;
+    vec_init(&shards);
+    compile_shards(nfa, force, &shards);
+    r.scanner = make_scanner(nfa, shards.data, shards.length);
+    r.scanner->keywords = keywords;
+
+    int fd = arg + 2 < argc ? open(argv[arg + 2], O_RDONLY) : STDIN_FILENO;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(argv[arg + 2]);
+        return 1;
+    }
+    char *mapped = S_ISREG(st.st_mode) && st.st_size > 0 && !anchored
+                       ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                       : MAP_FAILED;
+    if (mapped != MAP_FAILED)
+    {
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+        replace_run(&r, mapped, st.st_size, true);
+        munmap(mapped, st.st_size);
+    }
+    else
+    {
+        // what a chunk leaves unwritten moves to the front of the buffer,
+        // which doubles when a single token fills it
+        size_t capacity = INPUT_CHUNK;
+        char *buffer = malloc(capacity + 1);
+        size_t length = 0;
+        ssize_t n;
+        while ((n = read(fd, buffer + length, capacity - length)) > 0)
+        {
+            length += n;
+            size_t done = replace_run(&r, buffer, length, false);
+            memmove(buffer, buffer + done, length - done);
+            length -= done;
+            if (length == capacity)
+            {
+                capacity *= 2;
+                buffer = realloc(buffer, capacity + 1);
+            }
+        }
+        if (length > 0 && buffer[length - 1] != '\n' && anchored)
+        {
+            buffer[length++] = '\n';
+            r.trail = 1;
+        }
+        if (length > 0)
+        {
+            replace_run(&r, buffer, length, true);
+        }
+        free(buffer);
+    }
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+
+    scanner_free(r.scanner);
+    for (int g = 0; g < shards.length; ++g)
+    {
+        dfa_free(shards.data[g]);
+    }
+    vec_deinit(&shards);
+    nfa_free(nfa);
+    if (r.onepass)
+    {
+        onepass_free(r.onepass);
+    }
+    if (r.tdfa)
+    {
+        tdfa_free(r.tdfa);
+    }
+    free(r.regs);
+    nfa_free(captures);
+    free(r.literal);
+    vec_deinit(&r.parts);
+    return 0;
+}
+
+// a trigram index lists, for every three bytes, the files they occur in.
+// a pattern is planned into a boolean query over trigrams that every
+// matching line must satisfy, and only the files the query selects are
+// scanned. bytes are folded to lower case, so one index serves -i too
+#define TRIGRAM_MAGIC "PLTRIG01"
+// the largest set of exact strings a subpattern is expanded to
+#define TRIGRAM_MAX_EXACT 16
+
+#define TRIGRAM_ALL 0
+#define TRIGRAM_LEAF 1
+#define TRIGRAM_AND 2
+#define TRIGRAM_OR 3
+
+typedef struct trigram_query_t
+{
+    int op;
+    // TRIGRAM_LEAF
+    uint32_t trigram;
+    vec_t(struct trigram_query_t *) children;
+} trigram_query_t;
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    uint32_t files;
+    uint32_t trigrams;
+    // per file, the name and the size and mtime it was indexed at
+    const char **names;
+    uint64_t *sizes;
+    int64_t *mtimes;
+    // (trigram, count, offset) records, sorted by trigram
+    const char *table;
+    const unsigned char *postings;
+} trigram_index_t;
+
+static uint32_t trigram_key(unsigned char a, unsigned char b, unsigned char c)
+{
+    return (uint32_t)tolower(a) << 16 | (uint32_t)tolower(b) << 8 | (uint32_t)tolower(c);
+}
+
+static bool trigram_has_newline(uint32_t trigram)
+{
+    return (trigram >> 16) == '\n' || ((trigram >> 8) & 0xFF) == '\n' || (trigram & 0xFF) == '\n';
+}
+
+static trigram_query_t *trigram_query_new(int op)
+{
+    trigram_query_t *q = calloc(1, sizeof(trigram_query_t));
+    q->op = op;
+    vec_init(&q->children);
+    return q;
+}
+
+static void trigram_query_free(trigram_query_t *q)
+{
+    for (int i = 0; i < q->children.length; ++i)
+    {
+        trigram_query_free(q->children.data[i]);
+    }
+    vec_deinit(&q->children);
+    free(q);
+}
+
+static trigram_query_t *trigram_combine(int op, trigram_query_t *a, trigram_query_t *b)
+{
+    // TRIGRAM_ALL is the identity of an AND and absorbs an OR
+    if (a->op == TRIGRAM_ALL || b->op == TRIGRAM_ALL)
+    {
+        trigram_query_t *keep = op == TRIGRAM_AND ? (a->op == TRIGRAM_ALL ? b : a) : NULL;
+        if (keep != a)
+        {
+            trigram_query_free(a);
+        }
+        if (keep != b)
+        {
+            trigram_query_free(b);
+        }
+        return keep ? keep : trigram_query_new(TRIGRAM_ALL);
+    }
+    trigram_query_t *q = a->op == op ? a : trigram_query_new(op);
+    if (q != a)
+    {
+        vec_push(&q->children, a);
+    }
+    if (b->op == op)
+    {
+        vec_extend(&q->children, &b->children);
+        vec_deinit(&b->children);
+        free(b);
+    }
+    else
+    {
+        vec_push(&q->children, b);
+    }
+    return q;
+}
+
+static void trigram_strings_free(vec_str_t *strings)
+{
+    for (int i = 0; i < strings->length; ++i)
+    {
+        free(strings->data[i]);
+    }
+    vec_deinit(strings);
+}
+
+static trigram_query_t *trigram_strings(vec_str_t *strings)
+{
+    // any of the strings, each of which needs all of its trigrams. a
+    // string too short to have one matches every file
+    trigram_query_t *any = NULL;
+    for (int i = 0; i < strings->length; ++i)
+    {
+        const char *s = strings->data[i];
+        trigram_query_t *all = trigram_query_new(TRIGRAM_ALL);
+        for (size_t j = 0; s[j] && s[j + 1] && s[j + 2]; ++j)
+        {
+            uint32_t trigram = trigram_key(s[j], s[j + 1], s[j + 2]);
+            if (!trigram_has_newline(trigram))
+            {
+                trigram_query_t *leaf = trigram_query_new(TRIGRAM_LEAF);
+                leaf->trigram = trigram;
+                all = trigram_combine(TRIGRAM_AND, all, leaf);
+            }
+        }
+        any = any ? trigram_combine(TRIGRAM_OR, any, all) : all;
+    }
+    trigram_strings_free(strings);
+    return any ? any : trigram_query_new(TRIGRAM_ALL);
+}
+
+static void trigram_product(vec_str_t *a, vec_str_t *b)
+{
+    // a becomes every string of a followed by every string of b
+    vec_str_t out;
+    vec_init(&out);
+    for (int i = 0; i < a->length; ++i)
+    {
+        size_t length = strlen(a->data[i]);
+        for (int j = 0; j < b->length; ++j)
+        {
+            char *s = malloc(length + strlen(b->data[j]) + 1);
+            strcpy(s, a->data[i]);
+            strcpy(s + length, b->data[j]);
+            vec_push(&out, s);
+        }
+    }
+    trigram_strings_free(a);
+    trigram_strings_free(b);
+    *a = out;
+}
+
+static bool trigram_exact(const ast_t *ast, vec_str_t *exact)
+{
+    // the strings ast matches, folded to lower case, as long as there are
+    // at most TRIGRAM_MAX_EXACT of them
+    vec_init(exact);
+    switch (ast->kind)
+    {
+    case AST_EMPTY:
+        vec_push(exact, copy_string("", 0));
+        return true;
+    case AST_CHAR:
+    case AST_CLASS: {
+        bool members[0x100];
+        ast_members(ast, members);
+        bool folded[0x100] = {false};
+        for (int c = 1; c < 0x100; ++c)
+        {
+            if (members[c] && !folded[tolower(c)])
+            {
+                folded[tolower(c)] = true;
+                char s = tolower(c);
+                vec_push(exact, copy_string(&s, 1));
+            }
+        }
+        break;
+    }
+    case AST_CAT:
+        vec_push(exact, copy_string("", 0));
+        for (int i = 0; i < ast->children.length && exact->length <= TRIGRAM_MAX_EXACT; ++i)
+        {
+            vec_str_t next;
+            if (!trigram_exact(ast->children.data[i], &next) || exact->length * next.length > TRIGRAM_MAX_EXACT)
+            {
+                trigram_strings_free(&next);
+                trigram_strings_free(exact);
+                return false;
+            }
+            trigram_product(exact, &next);
+        }
+        break;
+    case AST_ALT:
+    case AST_QUESTION:
+        if (ast->kind == AST_QUESTION)
+        {
+            vec_push(exact, copy_string("", 0));
+        }
+        for (int i = 0; i < ast->children.length && exact->length <= TRIGRAM_MAX_EXACT; ++i)
+        {
+            vec_str_t next;
+            if (!trigram_exact(ast->children.data[i], &next))
+            {
+                trigram_strings_free(exact);
+                return false;
+            }
+            vec_extend(exact, &next);
+            vec_deinit(&next);
+        }
+        break;
+    case AST_GROUP:
+        return trigram_exact(ast->children.data[0], exact);
+    default:
+        return false;
+    }
+    if (exact->length > TRIGRAM_MAX_EXACT)
+    {
+        trigram_strings_free(exact);
+        return false;
+    }
+    return true;
+}
+
+static trigram_query_t *trigram_plan(const ast_t *ast)
+{
+    // a query every line ast matches in satisfies. runs of concatenated
+    // subpatterns with small exact sets are expanded together so their
+    // trigrams can span the joins; anything else only ANDs or ORs the
+    // plans of its parts
+    vec_str_t exact;
+    if (trigram_exact(ast, &exact))
+    {
+        return trigram_strings(&exact);
+    }
+    switch (ast->kind)
+    {
+    case AST_CAT: {
+        trigram_query_t *q = trigram_query_new(TRIGRAM_ALL);
+        vec_str_t run;
+        vec_init(&run);
+        vec_push(&run, copy_string("", 0));
+        for (int i = 0; i < ast->children.length; ++i)
+        {
+            const ast_t *child = ast->children.data[i];
+            if (!trigram_exact(child, &exact))
+            {
+                q = trigram_combine(TRIGRAM_AND, q, trigram_strings(&run));
+                q = trigram_combine(TRIGRAM_AND, q, trigram_plan(child));
+                vec_init(&run);
+                vec_push(&run, copy_string("", 0));
+                continue;
+            }
+            if (run.length * exact.length > TRIGRAM_MAX_EXACT)
+            {
+                q = trigram_combine(TRIGRAM_AND, q, trigram_strings(&run));
+                vec_init(&run);
+                vec_push(&run, copy_string("", 0));
+            }
+            trigram_product(&run, &exact);
+        }
+        return trigram_combine(TRIGRAM_AND, q, trigram_strings(&run));
+    }
+    case AST_ALT: {
+        trigram_query_t *q = trigram_plan(ast->children.data[0]);
+        for (int i = 1; i < ast->children.length; ++i)
+        {
+            q = trigram_combine(TRIGRAM_OR, q, trigram_plan(ast->children.data[i]));
+        }
+        return q;
+    }
+    case AST_PLUS:
+    case AST_GROUP:
+        return trigram_plan(ast->children.data[0]);
+    default:
+        return trigram_query_new(TRIGRAM_ALL);
+    }
+}
+
+static void trigram_print(FILE *fp, const trigram_query_t *q)
+{
+    if (q->op == TRIGRAM_ALL)
+    {
+        fputs("*", fp);
+        return;
+    }
+    if (q->op == TRIGRAM_LEAF)
+    {
+        fputc('"', fp);
+        for (int shift = 16; shift >= 0; shift -= 8)
+        {
+            unsigned char c = q->trigram >> shift;
+            fprintf(fp, isprint(c) && c != '"' && c != '\\' ? "%c" : "\\x%02x", c);
+        }
+        fputc('"', fp);
+        return;
+    }
+    fputc('(', fp);
+    for (int i = 0; i < q->children.length; ++i)
+    {
+        if (i)
+        {
+            fputs(q->op == TRIGRAM_AND ? " and " : " or ", fp);
+        }
+        trigram_print(fp, q->children.data[i]);
+    }
+    fputc(')', fp);
+}
+
+static void index_walk(const char *path, vec_str_t *paths)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        perror(path);
+        return;
+    }
+    if (S_ISREG(st.st_mode))
+    {
+        vec_push(paths, copy_string(path, strlen(path)));
+        return;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return;
+    }
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        perror(path);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        size_t length = strlen(path);
+        char *child = malloc(length + strlen(entry->d_name) + 2);
+        sprintf(child, length && path[length - 1] == '/' ? "%s%s" : "%s/%s", path, entry->d_name);
+        index_walk(child, paths);
+        free(child);
+    }
+    closedir(dir);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void put_varint(spill_t *out, uint32_t value)
+{
+    uint8_t bytes[5];
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        bytes[length++] = value | 0x80;
+        value >>= 7;
+    }
+    bytes[length++] = value;
+    spill_append(out, bytes, length);
+}
+
+static uint32_t get_varint(const unsigned char **p)
+{
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        unsigned char byte = *(*p)++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+}
+
+// (trigram, file) pairs are gathered up to INDEX_RUN_PAIRS at a time,
+// sorted and spilled as one run, and the runs merged once every file is
+// read, so the pairs of a large tree never have to fit in memory at once
+#define INDEX_RUN_PAIRS ((size_t)1 << 23)
+
+static void index_flush_run(uint64_t *pairs, size_t *count, spill_t *runs, vec_size_t *ends)
+{
+    if (*count == 0)
+    {
+        return;
+    }
+    qsort(pairs, *count, sizeof(uint64_t), compare_u64);
+    spill_append(runs, (const uint8_t *)pairs, *count * sizeof(uint64_t));
+    vec_push(ends, runs->length / sizeof(uint64_t));
+    *count = 0;
+}
+
+static void index_sift(int *heap, int length, int i, const uint64_t *pairs, const size_t *next)
+{
+    // restores the min-heap of runs, keyed by each run's next pair, below i
+    for (;;)
+    {
+        int least = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < length; ++child)
+        {
+            if (pairs[next[heap[child]]] < pairs[next[heap[least]]])
+            {
+                least = child;
+            }
+        }
+        if (least == i)
+        {
+            return;
+        }
+        int swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+static int index_main(int argc, char *argv[])
+{
+    // plainc index INDEX PATH...: every regular file under the paths
+    if (argc < 4)
+    {
+        return usage(argv[0]);
+    }
+    vec_str_t paths;
+    vec_init(&paths);
+    for (int i = 3; i < argc; ++i)
+    {
+        index_walk(argv[i], &paths);
+    }
+    vec_sort(&paths, compare_words);
+
+    // one pair per distinct trigram of each file; seen marks the trigrams
+    // of the current file. files are read a chunk at a time, the last two
+    // bytes of a chunk carried over to start the next
+    uint64_t *pairs = malloc(INDEX_RUN_PAIRS * sizeof(uint64_t));
+    size_t gathered = 0;
+    spill_t runs;
+    spill_init(&runs);
+    vec_size_t ends;
+    vec_init(&ends);
+    uint64_t *seen = calloc((1 << 24) / 64, sizeof(uint64_t));
+    unsigned char *chunk = malloc(INPUT_CHUNK + 2);
+    FILE *out = fopen(argv[2], "wb");
+    if (!out)
+    {
+        perror(argv[2]);
+        exit(1);
+    }
+    uint32_t files = paths.length;
+    fwrite(TRIGRAM_MAGIC, 1, 8, out);
+    fwrite(&files, sizeof(uint32_t), 1, out);
+    long count_at = ftell(out);
+    fwrite(&files, sizeof(uint32_t), 1, out);
+    for (uint32_t f = 0; f < files; ++f)
+    {
+        const char *path = paths.data[f];
+        FILE *fp = fopen(path, "rb");
+        struct stat st;
+        if (!fp || fstat(fileno(fp), &st) != 0)
+        {
+            perror(path);
+            exit(1);
+        }
+        size_t first = gathered;
+        bool spilled = false;
+        size_t kept = 0;
+        size_t n;
+        while ((n = fread(chunk + kept, 1, INPUT_CHUNK, fp)) > 0)
+        {
+            size_t length = kept + n;
+            for (size_t i = 0; i + 2 < length; ++i)
+            {
+                uint32_t trigram = trigram_key(chunk[i], chunk[i + 1], chunk[i + 2]);
+                if (!(seen[trigram >> 6] & (uint64_t)1 << (trigram & 63)) && !trigram_has_newline(trigram))
+                {
+                    seen[trigram >> 6] |= (uint64_t)1 << (trigram & 63);
+                    if (gathered == INDEX_RUN_PAIRS)
+                    {
+                        index_flush_run(pairs, &gathered, &runs, &ends);
+                        spilled = true;
+                    }
+                    pairs[gathered++] = (uint64_t)trigram << 32 | f;
+                }
+            }
+            kept = length < 2 ? length : 2;
+            memmove(chunk, chunk + length - kept, kept);
+        }
+        if (ferror(fp))
+        {
+            perror(path);
+            exit(1);
+        }
+        fclose(fp);
+        if (spilled)
+        {
+            // some of this file's pairs are in a run already
+            memset(seen, 0, (1 << 24) / 8);
         }
-        for (int j = 0; j < dfa->data[i]->chars.length; ++j)
+        for (size_t i = first; i < gathered && !spilled; ++i)
         {
-            for (int c = 0; c < 0x80; ++c)
-            {
-                if (bitset_get(dfa->data[i]->chars.data[j], c))
-                {
-                    dtran_row.data[c] = dfa->data[i]->next.data[j]->index;
-                }
-            }
+            uint32_t trigram = pairs[i] >> 32;
+            seen[trigram >> 6] = 0;
         }
-        vec_push(&result, dtran_row);
+        uint64_t size = st.st_size;
+        int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        fwrite(&size, sizeof(uint64_t), 1, out);
+        fwrite(&mtime, sizeof(int64_t), 1, out);
+        fwrite(path, 1, strlen(path) + 1, out);
     }
-    return result;
-}
+    index_flush_run(pairs, &gathered, &runs, &ends);
+    free(pairs);
+    free(chunk);
+    free(seen);
 
-static void show_dtran(const dtran_t *dtran)
-{
-    printf("{\n");
-    for (int i = 0; i < dtran->length; ++i)
+    // the table of (trigram, count, offset) goes out as the runs are
+    // merged, while the posting lists, each a run of varint gaps between
+    // file numbers, are spilled to follow it
+    const uint64_t *merged = (const uint64_t *)runs.data;
+    size_t *next = malloc((ends.length ? ends.length : 1) * sizeof(size_t));
+    int *heap = malloc((ends.length ? ends.length : 1) * sizeof(int));
+    int left = ends.length;
+    for (int r = 0; r < left; ++r)
     {
-        printf("  [%d] = { ", i);
-        for (int j = 0; j < dtran->data[i].length; ++j)
+        next[r] = r ? ends.data[r - 1] : 0;
+        heap[r] = r;
+    }
+    for (int i = left / 2 - 1; i >= 0; --i)
+    {
+        index_sift(heap, left, i, merged, next);
+    }
+    spill_t postings;
+    spill_init(&postings);
+    uint32_t trigrams = 0;
+    size_t total = 0;
+    while (left > 0)
+    {
+        uint32_t trigram = merged[next[heap[0]]] >> 32;
+        uint64_t offset = postings.length;
+        uint32_t previous = 0;
+        uint32_t count = 0;
+        while (left > 0 && merged[next[heap[0]]] >> 32 == trigram)
         {
-            printf("%d, ", dtran->data[i].data[j]);
+            int r = heap[0];
+            uint32_t file = (uint32_t)merged[next[r]];
+            put_varint(&postings, file - previous);
+            previous = file;
+            ++count;
+            if (++next[r] == ends.data[r])
+            {
+                heap[0] = heap[--left];
+            }
+            index_sift(heap, left, 0, merged, next);
         }
-        printf("},\n");
+        fwrite(&trigram, sizeof(uint32_t), 1, out);
+        fwrite(&count, sizeof(uint32_t), 1, out);
+        fwrite(&offset, sizeof(uint64_t), 1, out);
+        total += count;
+        ++trigrams;
     }
-    printf("};\n");
+    if (postings.length > 0)
+    {
+        fwrite(postings.data, 1, postings.length, out);
+    }
+    fseek(out, count_at, SEEK_SET);
+    fwrite(&trigrams, sizeof(uint32_t), 1, out);
+    fclose(out);
+    fprintf(stderr, "%u files, %u trigrams, %zu postings in %zu bytes\n", files, trigrams, total, postings.length);
+    free(next);
+    free(heap);
+    vec_deinit(&ends);
+    spill_free(&postings);
+    spill_free(&runs);
+    trigram_strings_free(&paths);
+    return 0;
 }
 
-static const char *bin_to_ascii(int c, bool use_hex)
+static void index_load(trigram_index_t *index, const char *path)
 {
-    static char buf[8];
-    c &= 0xFF;
-    if (' ' <= c && c < 0x7F && c != '\'' && c != '\\')
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
     {
-        buf[0] = c;
-        buf[1] = '\0';
+        perror(path);
+        exit(1);
     }
-    else
+    index->data = read_file(fp, &index->length);
+    fclose(fp);
+    const char *p = index->data;
+    const char *end = index->data + index->length;
+    if (index->length < 16 || memcmp(p, TRIGRAM_MAGIC, 8) != 0)
     {
-        buf[0] = '\\';
-        buf[2] = '\0';
-        switch (c)
+        fprintf(stderr, "%s is not a trigram index\n", path);
+        exit(1);
+    }
+    memcpy(&index->files, p + 8, sizeof(uint32_t));
+    memcpy(&index->trigrams, p + 12, sizeof(uint32_t));
+    p += 16;
+    index->names = malloc(index->files * sizeof(char *));
+    index->sizes = malloc(index->files * sizeof(uint64_t));
+    index->mtimes = malloc(index->files * sizeof(int64_t));
+    for (uint32_t f = 0; f < index->files; ++f)
+    {
+        const char *name = p + 16;
+        const char *nul = name < end ? memchr(name, '\0', end - name) : NULL;
+        if (!nul)
         {
-        case '\\':
-            buf[1] = '\\';
-            break;
-        case '\'':
-            buf[1] = '\'';
-            break;
-        case '\b':
-            buf[1] = 'b';
-            break;
-        case '\f':
-            buf[1] = 'f';
-            break;
-        case '\t':
-            buf[1] = 't';
-            break;
-        case '\r':
-            buf[1] = 'r';
-            break;
-        case '\n':
-            buf[1] = 'n';
-            break;
-        default:
-            sprintf(&buf[1], use_hex ? "x%03x" : "%03o", c);
-            break;
+            fprintf(stderr, "%s is truncated\n", path);
+            exit(1);
         }
+        memcpy(&index->sizes[f], p, sizeof(uint64_t));
+        memcpy(&index->mtimes[f], p + 8, sizeof(int64_t));
+        index->names[f] = name;
+        p = nul + 1;
     }
-    return buf;
+    if ((size_t)(end - p) < (size_t)index->trigrams * 16)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        exit(1);
+    }
+    index->table = p;
+    index->postings = (const unsigned char *)p + (size_t)index->trigrams * 16;
 }
 
-static void printv(FILE *fp, const char **argv)
+static void index_free(trigram_index_t *index)
 {
-    while (*argv)
-    {
-        fprintf(fp, "%s\n", *argv++);
-    }
+    free(index->names);
+    free(index->sizes);
+    free(index->mtimes);
+    free(index->data);
 }
 
-static void comment(FILE *fp, const char **argv)
+static void index_postings(const trigram_index_t *index, uint32_t trigram, vec_int_t *files)
 {
-    fprintf(fp, "\n/*---------------------------------------\n");
-    while (*argv)
+    // binary search of the table, then the gaps decoded into file numbers
+    uint32_t lo = 0;
+    uint32_t hi = index->trigrams;
+    while (lo < hi)
     {
-        fprintf(fp, " * %s\n", *argv++);
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t key;
+        memcpy(&key, index->table + (size_t)mid * 16, sizeof(uint32_t));
+        if (key < trigram)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    uint32_t key = 0;
+    if (lo < index->trigrams)
+    {
+        memcpy(&key, index->table + (size_t)lo * 16, sizeof(uint32_t));
+    }
+    if (lo == index->trigrams || key != trigram)
+    {
+        return;
+    }
+    uint32_t count;
+    uint64_t offset;
+    memcpy(&count, index->table + (size_t)lo * 16 + 4, sizeof(uint32_t));
+    memcpy(&offset, index->table + (size_t)lo * 16 + 8, sizeof(uint64_t));
+    const unsigned char *p = index->postings + offset;
+    uint32_t file = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        file += get_varint(&p);
+        vec_push(files, file);
     }
-    fprintf(fp, " */\n\n");
 }
 
-static int pairs(FILE *fp, const dtran_t *dtran, const char *name, int threshold, bool numbers)
+static bool index_query(const trigram_index_t *index, const trigram_query_t *q, vec_int_t *files)
 {
-    // https://stackoverflow.com/a/29960371
-
-    int num_cells = 0;
-    for (int i = 0; i < dtran->length; ++i)
+    // the sorted files q selects, or false when it selects all of them
+    vec_init(files);
+    if (q->op == TRIGRAM_ALL)
     {
-        int ntransitions = 0;
-        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        return false;
+    }
+    if (q->op == TRIGRAM_LEAF)
+    {
+        index_postings(index, q->trigram, files);
+        return true;
+    }
+    bool restricted = false;
+    for (int i = 0; i < q->children.length; ++i)
+    {
+        vec_int_t other;
+        if (!index_query(index, q->children.data[i], &other))
         {
-            if (*p != -1)
+            vec_deinit(&other);
+            if (q->op == TRIGRAM_OR)
             {
-                ++ntransitions;
+                vec_deinit(files);
+                return false;
             }
+            continue;
         }
-        if (ntransitions > 0)
+        if (!restricted)
         {
-            fprintf(fp, "%s %s %s%-d[] = { ", STORAGE_CLASS, TYPE, name, i);
-            ++num_cells;
-            if (ntransitions > threshold)
-            {
-                fprintf(fp, "0,\n" INDENT);
-            }
-            else
+            vec_deinit(files);
+            *files = other;
+            restricted = true;
+            continue;
+        }
+        // merge the two sorted lists, keeping what both have for an AND
+        // and what either has for an OR
+        vec_int_t merged;
+        vec_init(&merged);
+        int a = 0;
+        int b = 0;
+        while (a < files->length || b < other.length)
+        {
+            int x = a < files->length ? files->data[a] : INT32_MAX;
+            int y = b < other.length ? other.data[b] : INT32_MAX;
+            if (x == y || q->op == TRIGRAM_OR)
             {
-                fprintf(fp, "%5d, ", ntransitions);
-                if (threshold > 5)
-                {
-                    fprintf(fp, "\n" INDENT);
-                }
+                vec_push(&merged, x < y ? x : y);
             }
+            a += x <= y;
+            b += y <= x;
+        }
+        vec_deinit(files);
+        vec_deinit(&other);
+        *files = merged;
+    }
+    return restricted;
+}
 
-            int nprinted = dtran->data[i].length;
-            int ncommas = ntransitions;
-            for (int *p = dtran->data[i].data, j = 0; j < dtran->data[i].length; ++j, ++p)
-            {
-                if (ntransitions > threshold)
-                {
-                    ++num_cells;
-                    --nprinted;
-                    fprintf(fp, "%5d", *p);
-                    if (j < dtran->data[i].length - 1)
-                    {
-                        fprintf(fp, ", ");
-                    }
-                }
-                else if (*p != -1)
-                {
-                    num_cells += 2;
-                    if (numbers)
-                    {
-                        fprintf(fp, "%d,%d", j, *p);
-                    }
-                    else
-                    {
-                        fprintf(fp, "'%s',%d", bin_to_ascii(j, 0), *p);
-                    }
-                    nprinted -= 2;
-                    if (--ncommas > 0)
-                    {
-                        fprintf(fp, ", ");
-                    }
-                }
-                if (nprinted <= 0)
-                {
-                    fprintf(fp, "\n" INDENT);
-                    nprinted = dtran->data[i].length;
-                }
-            }
-            fprintf(fp, "};\n");
+static int search_main(int argc, char *argv[])
+{
+    // plainc search [-i] [-f] [-q] [-n] INDEX PATTERN: the lines of
+    // indexed files the pattern matches, as path:line, or path:number:line
+    // with -n. files that changed since they were indexed are always
+    // scanned; files added since are not seen
+    int flags = REGEX_PATTERN;
+    bool force = false;
+    bool plan = false;
+    bool numbered = false;
+    int arg = 2;
+    for (; arg < argc; ++arg)
+    {
+        if (strcmp(argv[arg], "-i") == 0)
+        {
+            flags |= REGEX_FOLD_CASE;
+        }
+        else if (strcmp(argv[arg], "-f") == 0)
+        {
+            force = true;
+        }
+        else if (strcmp(argv[arg], "-q") == 0)
+        {
+            plan = true;
+        }
+        else if (strcmp(argv[arg], "-n") == 0)
+        {
+            numbered = true;
+        }
+        else
+        {
+            break;
         }
     }
-    fprintf(fp, "\n%s %s *%s[%d] =\n{\n" INDENT, STORAGE_CLASS, TYPE, name, dtran->length);
-    int nprinted = 10;
-    for (int i = 0; i < dtran->length - 1; ++i)
+    if (arg + 2 != argc)
     {
-        int ntransitions = 0;
-        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        return usage(argv[0]);
+    }
+    trigram_index_t index;
+    index_load(&index, argv[arg]);
+    const char *pattern = argv[arg + 1];
+    ast_t *ast = pattern_ast(pattern, flags);
+    trigram_query_t *q = trigram_plan(ast);
+    ast_free(ast);
+    if (plan)
+    {
+        trigram_print(stderr, q);
+        fputc('\n', stderr);
+    }
+    vec_int_t candidates;
+    bool restricted = index_query(&index, q, &candidates);
+    trigram_query_free(q);
+
+    nfa_t *nfa = thompson(pattern, flags);
+    nfa_search(nfa);
+    dfa_t *dfa = compile_dfa(nfa, force);
+    dfa_t *min = minimize_dfa(dfa);
+    dfa_free(dfa);
+    nfa_free(nfa);
+    sheng_t *sheng = make_sheng(min);
+
+    int next = 0;
+    for (uint32_t f = 0; f < index.files; ++f)
+    {
+        bool candidate = !restricted || (next < candidates.length && candidates.data[next] == (int)f);
+        next += candidate && restricted;
+        struct stat st;
+        if (stat(index.names[f], &st) != 0)
         {
-            if (*p != -1)
+            continue;
+        }
+        int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        if (!candidate && (uint64_t)st.st_size == index.sizes[f] && mtime == index.mtimes[f])
+        {
+            continue;
+        }
+        FILE *fp = fopen(index.names[f], "rb");
+        if (!fp)
+        {
+            perror(index.names[f]);
+            continue;
+        }
+        size_t length;
+        char *text = read_file(fp, &length);
+        fclose(fp);
+        // most files have no match, so line numbers come from a newline
+        // index built at the first one rather than from counting
+        line_index_t lines;
+        bool counted = false;
+        for (size_t start = 0; start < length;)
+        {
+            const char *newline = memchr(text + start, '\n', length - start);
+            size_t end = newline ? (size_t)(newline - text) : length;
+            if (filter_line(min, sheng, text + start, end - start, false))
             {
-                ++ntransitions;
+                printf("%s:", index.names[f]);
+                if (numbered)
+                {
+                    if (!counted)
+                    {
+                        line_index_init(&lines, text, length);
+                        counted = true;
+                    }
+                    printf("%zu:", line_index_rank(&lines, start) + 1);
+                }
+                fwrite(text + start, 1, end - start, stdout);
+                fputc('\n', stdout);
             }
+            start = end + 1;
         }
-        fprintf(fp, ntransitions ? "%s%-d, " : "NULL, ", name, i);
-        if (--nprinted <= 0)
+        if (counted)
         {
-            fprintf(fp, "\n" INDENT);
-            nprinted = 10;
+            line_index_free(&lines);
         }
+        free(text);
     }
-    fprintf(fp, "%s%-d\n};\n\n", name, dtran->length - 1);
-    return num_cells;
-}
-
-static void pnext(FILE *fp, const char *name)
-{
-    static const char *toptext[] = {
-        "Given the current state and the current input character, return ",
-        "the next state.",
-        NULL,
-    };
-    static const char *boptext[] = {
-        "  int i;", "  if (p)",
-        "  {",      "    if ((i = *p++) == 0)",
-        "    {",    "      return p[c];",
-        "    }",    "    for (; --i >= 0; p += 2)",
-        "    {",    "      if (c == p[0])",
-        "      {",  "        return p[1];",
-        "      }",  "    }",
-        "  }",      "  return YYF;",
-        "}",        NULL,
-    };
-    fprintf(fp, "\n/*------------------------------------------------*/\n");
-    fprintf(fp, "%s %s yy_next(int cur_state, unsigned int c)\n", DECODING_ROUTINE_STORAGE_CLASS, TYPE);
-    fprintf(fp, "{\n");
-    comment(fp, toptext);
-    fprintf(fp, "  %s *p = %s[cur_state];\n", TYPE, name);
-    printv(fp, boptext);
+    vec_deinit(&candidates);
+    if (sheng)
+    {
+        sheng_free(sheng);
+    }
+    dfa_free(min);
+    index_free(&index);
+    return 0;
 }
 
 typedef struct
@@ -1176,12 +8684,49 @@ static void print_row_map(FILE *fp, int a);
 
 int main(int argc, char *argv[])
 {
-    nfa_t *nfa = thompson("^[ \\t]*//[ \\t]*TRACE[ \\t]*#[0-9]+[ \\t]*$");
+    if (argc > 1)
+    {
+        if (strcmp(argv[1], "scan") == 0)
+        {
+            return scan_main(argc, argv);
+        }
+        if (strcmp(argv[1], "table") == 0)
+        {
+            return table_main(argc, argv);
+        }
+        if (strcmp(argv[1], "relex") == 0)
+        {
+            return relex_main(argc, argv);
+        }
+        if (strcmp(argv[1], "filter") == 0)
+        {
+            return filter_main(argc, argv);
+        }
+        if (strcmp(argv[1], "extract") == 0)
+        {
+            return extract_main(argc, argv);
+        }
+        if (strcmp(argv[1], "replace") == 0)
+        {
+            return replace_main(argc, argv);
+        }
+        if (strcmp(argv[1], "index") == 0)
+        {
+            return index_main(argc, argv);
+        }
+        if (strcmp(argv[1], "search") == 0)
+        {
+            return search_main(argc, argv);
+        }
+        return usage(argv[0]);
+    }
+
+    nfa_t *nfa = thompson("^[ \\t]*\\/\\/[ \\t]*TRACE[ \\t]*#[0-9]+[ \\t]*$", 0);
     // nfa_print(&nfa);
-    nfa_t *nfa2 = thompson("^[ \\t]*#[0-9]+.*$");
+    nfa_t *nfa2 = thompson("^[ \\t]*#[0-9]+.*$", 0);
     // nfa_print(&nfa2);
 
-    dfa_t *dfa = nfa_to_dfa(nfa2);
+    dfa_t *dfa = nfa_to_dfa(nfa2, NULL);
     dfa_to_dot(dfa);
     dfa_t *min = minimize_dfa(dfa);
     dfa_to_dot(min);
@@ -1199,6 +8744,9 @@ int main(int argc, char *argv[])
     pairs(stdout, &dtran, "test", 5, true);
     pnext(stdout, "yy_next");
 
+    bitmap_pairs(stdout, &dtran, "test");
+    bitmap_next(stdout, "test");
+
     for (int i = 0; i < dtran.length; ++i)
     {
         vec_deinit(&dtran.data[i]);